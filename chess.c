@@ -1,10 +1,32 @@
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
 #include <linux/device.h>
 #include <linux/string.h>
 #include <linux/uaccess.h>  
 #include <linux/random.h>
+#include <linux/log2.h>
+#include <linux/vmalloc.h>
+#include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/wait.h>
+#include <linux/bitops.h>
+#include <linux/firmware.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#include "nnue_avx2.h"
+#endif
 
 // declaring my device and class name for my driver as well as board size and empty piece
 #define DEVICE_NAME "chess"
@@ -12,6 +34,89 @@
 #define BOARD_SIZE 8
 #define EMPTY 0
 
+// size of the reply buffer, large enough for a full multi-pv analysis iteration
+#define MESSAGE_SIZE 8192
+
+// limits for the cpu search: moves per position and the most plies from the root search_max_ply may allow
+// the search keeps its plies in the heap allocated search frames and not on the kernel stack, so MAX_PLY only costs memory
+#define MAX_MOVES 256
+#define MAX_PLY 128
+
+// search scores, a mate found at ply N scores MATE_SCORE - N
+#define INFINITE_SCORE 32000
+#define MATE_SCORE 30000
+
+// move ordering buckets, the transposition table move goes first and quiet moves are ordered by killers, countermove and then history
+// captures that lose material by SEE go after every quiet move
+#define HASH_MOVE_SCORE 2000000
+#define GOOD_CAPTURE_SCORE 1000000
+#define KILLER1_SCORE 900000
+#define KILLER2_SCORE 800000
+#define COUNTERMOVE_SCORE 700000
+#define BAD_CAPTURE_SCORE -1000000
+
+// most lines an analysis (06) may report
+#define MAX_MULTIPV 8
+
+// longest mate the solver (05) looks for, its proof recurses once per ply (about 100 bytes of kernel stack each)
+#define MAX_MATE_MOVES 16
+
+// most threads one search may use, the caller's own thread included
+#define MAX_SEARCH_THREADS 64
+
+// most split points one thread may own at a time (they nest along its current line)
+#define MAX_SPLITS 8
+
+// entries in each search context's pawn hash table (a power of two)
+#define PAWN_HASH_ENTRIES 1024
+
+// the material key packs a 4 bit count of every piece type but the king for each side (indexed by SIDE_INDEX),
+// MATERIAL_SHIFT is where a count sits and MATERIAL_HASH_ENTRIES the size of each search context's material table
+#define MATERIAL_SHIFT(side, type) (4 * ((side) * (KING - 1) + (type) - 1))
+#define MATERIAL_COUNT(key, side, type) ((int)(((key) >> MATERIAL_SHIFT(side, type)) & 15))
+#define MATERIAL_HASH_ENTRIES 256
+
+// king and pawn against king positions, white having the pawn on files a to d and ranks 2 to 7: white king square,
+// black king square, side to move and the pawn's file and rank, see kpk_index
+#define KPK_INDEXES (2 * 24 * BOARD_SIZE * BOARD_SIZE * BOARD_SIZE * BOARD_SIZE)
+
+// results while the bitbase is built, combined as bits when a position's moves are looked at
+#define KPK_INVALID 0
+#define KPK_UNKNOWN 1
+#define KPK_DRAW 2
+#define KPK_WIN 4
+
+// shape of the optional evaluation network: HalfKP inputs (own king square x 10 non-king pieces x 64 squares, seen
+// from each side), NNUE_L1 first layer sums per side, two hidden layers and one output, all quantized
+// the hidden layers take their inputs clipped to 0..127 and shift their sums right by NNUE_SHIFT,
+// the output divided by NNUE_SCALE is in centipawns
+#define NNUE_INPUTS (BOARD_SIZE * BOARD_SIZE * 10 * BOARD_SIZE * BOARD_SIZE)
+#define NNUE_L1 256
+#define NNUE_L2 32
+#define NNUE_L3 32
+#define NNUE_SHIFT 6
+#define NNUE_SCALE 16
+#define NNUE_MAGIC 0x45554e43
+#define NNUE_VERSION 1
+
+// parallel search modes for search_smp_mode
+#define SMP_LAZY 0
+#define SMP_YBWC 1
+#define SMP_ROOT 2
+
+// every this many nodes (a power of two) the search gives up the cpu if needed and checks for a fatal signal
+#define SEARCH_CHECK_NODES 1024
+
+// history scores are halved whenever one of them grows past this
+#define HISTORY_MAX 65536
+
+// square and side indexes for the ordering tables
+#define SQUARE(row, col) ((row) * BOARD_SIZE + (col))
+#define SIDE_INDEX(side) ((side) > 0 ? 0 : 1)
+
+// late move reductions are looked up by [depth][moves searched], move counts past the end share the last column
+#define LMR_MOVES 64
+
 // enums for my pieces, will be storing in int array
 enum pieces {
     PAWN = 1,
@@ -22,40 +127,594 @@ enum pieces {
     KING = 6
 };
 
+// first layer sums of the network for both points of view (indexed by SIDE_INDEX)
+struct nnue_accumulator {
+    s16 values[2][NNUE_L1] __aligned(32);
+};
+
+// the network as loaded from its firmware file, feature_weights (NNUE_INPUTS rows of NNUE_L1) is allocated apart
+// the file holds a header of six little-endian u32 (magic, version and the four sizes) and then these fields in order
+struct nnue_net {
+    s16 *feature_weights;
+    s16 feature_biases[NNUE_L1] __aligned(32);
+    s32 l1_biases[NNUE_L2];
+    s8 l1_weights[NNUE_L2][2 * NNUE_L1] __aligned(32);
+    s32 l2_biases[NNUE_L3];
+    s8 l2_weights[NNUE_L3][NNUE_L2] __aligned(32);
+    s32 out_bias;
+    s8 out_weights[NNUE_L3] __aligned(32);
+};
+
 // chess game struct to populate board, store locations of both kings, check player turn and if player is in check
+// mg_score and eg_score are the running middlegame and endgame material plus piece-square sums (white positive)
+// and phase the running sum of phase_weight over all pieces, PHASE_MAX with every piece on the board
+// pawn_key is the zobrist key of the pawns alone, kept by the search like key
+// material is the material key, kept up to date like the running sums
+// accumulator is this position's entry on a search context's network stack (NULL when no network is in use),
+// make_move fills the next entry and moves it up, unmake_move moves it back down
 struct chess_game {
     int board[BOARD_SIZE][BOARD_SIZE];
     int white_king[2];  
     int black_king[2];
     int current_turn;  
     bool check;  
+    u64 key;
+    u64 pawn_key;
+    u64 material;
+    int mg_score;
+    int eg_score;
+    int phase;
+    struct nnue_accumulator *accumulator;
 };
 
 // struct that holds cpu moves so infinite loop does not occur
+// promotion is the signed piece a pawn turns into (0 if none) and score is used for move ordering
 struct cpu_move {
     int start_row;
     int start_col;
     int end_row;
     int end_col;
+    int promotion;
+    int score;
+};
+
+// what the search needs to take back a move made with make_move
+struct search_undo {
+    int moved;
+    int captured;
+    u64 key;
+    u64 pawn_key;
+    u64 material;
+    int mg_score;
+    int eg_score;
+    int phase;
+};
+
+// bounds stored in the transposition table: the score is exact, at least (failed high) or at most (failed low)
+enum tt_bound {
+    TT_NONE,
+    TT_UPPER,
+    TT_LOWER,
+    TT_EXACT
+};
+
+// one transposition table slot, the best move is kept as its two squares and the signed promotion piece
+// generation tells entries of the current search from older ones so those are replaced first
+// the table is shared by every search thread without a lock: a slot holds data and key ^ data, so a slot
+// read while another thread was writing it does not decode to the key it was probed with and is ignored
+struct tt_entry {
+    u64 key;
+    union {
+        u64 data;
+        struct {
+            s16 score;
+            s8 depth;
+            u8 bound;
+            u8 generation;
+            u8 start;
+            u8 end;
+            s8 promotion;
+        };
+    };
+};
+
+// the steps of a search_alphabeta node, one waiting for its child's score is left at the step that takes the score:
+// after the null move, after a move's (maybe reduced) zero window search, its full depth one, its full window one or a capture
+enum search_stage {
+    SEARCH_ENTER,
+    SEARCH_NULL_MOVE,
+    SEARCH_MOVES,
+    SEARCH_NEXT_MOVE,
+    SEARCH_REDUCED,
+    SEARCH_ZERO_WINDOW,
+    SEARCH_FULL_WINDOW,
+    SEARCH_END,
+    SEARCH_NEXT_CAPTURE,
+    SEARCH_CAPTURE
+};
+
+// everything the search keeps for one ply: its move list, the move being searched and how to take it back,
+// the two killers (quiet moves that caused a beta cutoff), the transposition table move and the principal variation found below it
+// the node's depth, window, move loop and the stage it is at live here too, search_alphabeta keeps nothing per ply on the kernel stack
+struct search_frame {
+    struct cpu_move moves[MAX_MOVES];
+    int count;
+    struct cpu_move move;
+    struct search_undo undo;
+    struct cpu_move killers[2];
+    struct cpu_move hash_move;
+    struct cpu_move pv[MAX_PLY];
+    int pv_length;
+    int depth;
+    int alpha;
+    int beta;
+    int alpha_start;
+    int index;
+    int legal;
+    int reduction;
+    bool check;
+    bool quiet;
+    enum search_stage stage;
+};
+
+// a node whose moves are shared between threads (young brothers wait: only after its eldest move was searched)
+// moves points into the owner's frame, next is the next one to hand out and alpha the best score so far
+// workers counts the helpers that joined, cutoff tells everyone still searching a move of it to give up
+// the fields after lock are only touched with it held, pv is the line of the best move as a worker found it
+// once the owner took it off its deque it sets closing and, until the last worker left, helps with the split points
+// those workers opened below it, the last one to leave wakes it
+struct split_point {
+    struct search_context *owner;
+    struct split_point *parent;
+    struct chess_game board;
+    struct cpu_move previous;
+    struct cpu_move *moves;
+    int count;
+    int depth;
+    int beta;
+    int ply;
+    bool check;
+    spinlock_t lock;
+    int next;
+    int alpha;
+    bool cutoff;
+    int workers;
+    bool closing;
+    struct cpu_move pv[MAX_PLY];
+    int pv_length;
+};
+
+// the attack sets one evaluation builds (bitboards indexed by SQUARE, sides by SIDE_INDEX)
+// king_zone is a king's square and the squares around it, zone_attacks counts how many times side's pieces
+// attack squares of the enemy king zone, zone_attackers how many pieces do and zone_weight sums those attacks
+// weighted by the attacking piece
+struct eval_info {
+    u64 occupied;
+    u64 pieces[2];
+    u64 pawn_attacks[2];
+    u64 king_zone[2];
+    int zone_attacks[2];
+    int zone_attackers[2];
+    int zone_weight[2];
+};
+
+// what the pawn structure alone is worth (white positive): passed, isolated, doubled and backward pawns
+// shield is, for each side and file, the rank counted from that side's back rank of its rearmost pawn there (0 if none),
+// the king shield is scored from it once the king's square is known
+struct pawn_entry {
+    u64 key;
+    int mg_score;
+    int eg_score;
+    u8 shield[2][BOARD_SIZE];
+};
+
+// what a material key says about the position: the imbalance (white positive, both phases), the factor out of
+// SCALE_NORMAL the score is scaled by when each side (indexed by SIDE_INDEX) is ahead, and for the endgames that
+// need their own knowledge the evaluator that replaces the usual evaluation and the side (1 or -1) it is for
+// a cleared entry is the right one for bare kings
+struct material_entry {
+    u64 key;
+    int imbalance;
+    u8 scale[2];
+    s8 strong;
+    int (*endgame)(struct chess_game *game, int strong);
+};
+
+// search state kept for the whole game, frames holds max_ply search frames allocated when the game starts
+// history is indexed [side][from][to] and countermoves holds the reply that refuted a move, indexed [moved piece + KING][to]
+// nodes counts positions visited by the current search and stop makes every level of it return at once
+// eval_probes and eval_hits count its evaluations and how many of them the evaluation cache answered
+// deadline is armed for the length of a timed search and sets stop when it fires, node_limit (if not 0) stops it by node count
+// seed is 0 except for helper threads, which get one each, the search's random numbers come from it and the position's zobrist key
+// so the same position always gets the same ones
+// expected is the rest of the last pv after the cpu move and the reply it predicted, expected_key the position it starts from
+// line is the root pv of the last iteration the current search finished
+// thread is 0 for the context of dev_write and the background work, helper threads have their own contexts numbered from 1
+// split is the split point whose move this thread is searching, one it owns or one it joined, and cut is raised once that split
+// point or one above it is aborted: it unwinds the search back to the split point without stopping it, unlike stop
+// splits are the split points this thread owns, split_count of them in use
+// pawns caches pawn structures by pawn key and materials the same for material keys, each thread has its own so they
+// need no locking
+// accumulators is the network stack, max_ply + 1 entries allocated with the frames when a network is loaded
+struct search_context {
+    struct chess_game board;
+    struct search_frame *frames;
+    int max_ply;
+    unsigned long nodes;
+    unsigned long node_limit;
+    unsigned long eval_probes;
+    unsigned long eval_hits;
+    bool stop;
+    struct hrtimer deadline;
+    u64 seed;
+    int history[2][BOARD_SIZE * BOARD_SIZE][BOARD_SIZE * BOARD_SIZE];
+    struct cpu_move countermoves[2 * KING + 1][BOARD_SIZE * BOARD_SIZE];
+    struct cpu_move expected[MAX_PLY];
+    int expected_length;
+    u64 expected_key;
+    struct cpu_move line[MAX_PLY];
+    int line_length;
+    int thread;
+    struct split_point *split;
+    bool cut;
+    struct split_point splits[MAX_SPLITS];
+    int split_count;
+    struct pawn_entry pawns[PAWN_HASH_ENTRIES];
+    struct material_entry materials[MATERIAL_HASH_ENTRIES];
+    struct nnue_accumulator *accumulators;
+};
+
+// the split points a thread offers to the others, oldest (nearest the root, so the most work) first
+struct split_deque {
+    spinlock_t lock;
+    struct split_point *splits[MAX_SPLITS];
+    int count;
+};
+
+// one line of a multi-pv analysis: the score and principal variation of the k-th best root move
+struct analysis_line {
+    int score;
+    struct cpu_move pv[MAX_PLY];
+    int pv_length;
+};
+
+// background analysis started by 06, the work searches search_ctx from root (a copy of the game when it started)
+// running is only changed by dev_write, text is where the work formats an iteration before publishing it
+struct analysis_job {
+    struct work_struct work;
+    struct chess_game root;
+    int lines;
+    int threads;
+    bool running;
+    struct analysis_line line[MAX_MULTIPV];
+    char text[MESSAGE_SIZE];
+};
+
+// pondering: after a cpu move the search goes on in the background on the player reply its pv predicts
+// best is the cpu move the ponder search found, hit is set (with hit_time) when the player plays predicted
+// aged tells the next cpu move that ponder_start already aged the ordering tables for it, hit or not
+struct ponder_job {
+    struct work_struct work;
+    struct cpu_move predicted;
+    struct cpu_move best;
+    bool running;
+    bool found;
+    bool hit;
+    bool aged;
+    ktime_t hit_time;
+};
+
+// piece values used for capture ordering and static exchange evaluation (indexed by abs(piece))
+static const int piece_value[KING + 1] = {0, 100, 320, 330, 500, 900, 20000};
+
+// evaluation material, middlegame and endgame (indexed by abs(piece), kings are always there so they count nothing)
+static const int material_mg[KING + 1] = {0, 82, 337, 365, 477, 1025, 0};
+static const int material_eg[KING + 1] = {0, 94, 281, 297, 512, 936, 0};
+
+// how much each piece (indexed by abs(piece)) counts towards the middlegame, pawns and kings do not
+// the starting position adds up to PHASE_MAX, promotions can go past it so the evaluation clamps it
+static const int phase_weight[KING + 1] = {0, 0, 1, 1, 2, 4, 0};
+#define PHASE_MAX 24
+
+// material imbalance: a pair of bishops, and knights gaining and rooks losing value with every own pawn past five
+// draw scale factors out of SCALE_NORMAL, and the bonus that makes an endgame evaluator's won positions score as won
+#define BISHOP_PAIR 40
+#define KNIGHT_PAWNS 6
+#define ROOK_PAWNS 12
+#define SCALE_NORMAL 64
+#define ENDGAME_WIN 1000
+
+// pawn structure terms, passed pawn bonuses are indexed by the rank counted from the pawn's own side
+static const int passed_mg[BOARD_SIZE] = {0, 5, 10, 15, 25, 40, 60, 0};
+static const int passed_eg[BOARD_SIZE] = {0, 10, 15, 25, 40, 65, 100, 0};
+#define DOUBLED_MG 10
+#define DOUBLED_EG 20
+#define ISOLATED_MG 10
+#define ISOLATED_EG 15
+#define BACKWARD_MG 8
+#define BACKWARD_EG 10
+
+// mobility: per safe square a piece reaches (not own pieces, not guarded by enemy pawns), counted from a typical
+// number of squares up so a piece with average scope scores 0 (indexed by abs(piece))
+static const int mobility_mg[KING + 1] = {0, 0, 4, 5, 2, 1, 0};
+static const int mobility_eg[KING + 1] = {0, 0, 4, 5, 4, 2, 0};
+static const int mobility_base[KING + 1] = {0, 0, 4, 7, 7, 14, 0};
+
+// king safety: each attack on a king zone square weighs by the attacker (indexed by abs(piece)) and the danger grows
+// with the square of the total, up to KING_DANGER_MAX, once at least two pieces take part
+// a file next to the king with no pawn of either side costs on top of the missing shield
+static const int zone_attack_weight[KING + 1] = {0, 0, 2, 2, 3, 5, 0};
+#define KING_DANGER_MAX 500
+#define KING_OPEN_FILE 20
+
+// bitboards of the a and h files, to drop the squares a shifted pawn set wraps around to
+#define FILE_A_SET 0x0101010101010101ULL
+#define FILE_H_SET 0x8080808080808080ULL
+
+// king shield: a pawn one or two ranks in front of a king still on its first two ranks, or no pawn at all on that file
+#define SHIELD_NEAR 10
+#define SHIELD_FAR 5
+#define SHIELD_OPEN 15
+
+// piece-square bonuses as seen from white with rank 8 first, black uses them mirrored
+// the same table serves both phases except for pawns (pushing matters more late) and the king (it hides early, centralizes late)
+static const int pst[KING + 1][BOARD_SIZE * BOARD_SIZE] = {
+    {0},
+    {  0,   0,   0,   0,   0,   0,   0,   0,
+      50,  50,  50,  50,  50,  50,  50,  50,
+      10,  10,  20,  30,  30,  20,  10,  10,
+       5,   5,  10,  25,  25,  10,   5,   5,
+       0,   0,   0,  20,  20,   0,   0,   0,
+       5,  -5, -10,   0,   0, -10,  -5,   5,
+       5,  10,  10, -20, -20,  10,  10,   5,
+       0,   0,   0,   0,   0,   0,   0,   0},
+    {-50, -40, -30, -30, -30, -30, -40, -50,
+     -40, -20,   0,   0,   0,   0, -20, -40,
+     -30,   0,  10,  15,  15,  10,   0, -30,
+     -30,   5,  15,  20,  20,  15,   5, -30,
+     -30,   0,  15,  20,  20,  15,   0, -30,
+     -30,   5,  10,  15,  15,  10,   5, -30,
+     -40, -20,   0,   5,   5,   0, -20, -40,
+     -50, -40, -30, -30, -30, -30, -40, -50},
+    {-20, -10, -10, -10, -10, -10, -10, -20,
+     -10,   0,   0,   0,   0,   0,   0, -10,
+     -10,   0,   5,  10,  10,   5,   0, -10,
+     -10,   5,   5,  10,  10,   5,   5, -10,
+     -10,   0,  10,  10,  10,  10,   0, -10,
+     -10,  10,  10,  10,  10,  10,  10, -10,
+     -10,   5,   0,   0,   0,   0,   5, -10,
+     -20, -10, -10, -10, -10, -10, -10, -20},
+    {  0,   0,   0,   0,   0,   0,   0,   0,
+       5,  10,  10,  10,  10,  10,  10,   5,
+      -5,   0,   0,   0,   0,   0,   0,  -5,
+      -5,   0,   0,   0,   0,   0,   0,  -5,
+      -5,   0,   0,   0,   0,   0,   0,  -5,
+      -5,   0,   0,   0,   0,   0,   0,  -5,
+      -5,   0,   0,   0,   0,   0,   0,  -5,
+       0,   0,   0,   5,   5,   0,   0,   0},
+    {-20, -10, -10,  -5,  -5, -10, -10, -20,
+     -10,   0,   0,   0,   0,   0,   0, -10,
+     -10,   0,   5,   5,   5,   5,   0, -10,
+      -5,   0,   5,   5,   5,   5,   0,  -5,
+       0,   0,   5,   5,   5,   5,   0,  -5,
+     -10,   5,   5,   5,   5,   5,   0, -10,
+     -10,   0,   5,   0,   0,   0,   0, -10,
+     -20, -10, -10,  -5,  -5, -10, -10, -20},
+    {-30, -40, -40, -50, -50, -40, -40, -30,
+     -30, -40, -40, -50, -50, -40, -40, -30,
+     -30, -40, -40, -50, -50, -40, -40, -30,
+     -30, -40, -40, -50, -50, -40, -40, -30,
+     -20, -30, -30, -40, -40, -30, -30, -20,
+     -10, -20, -20, -20, -20, -20, -20, -10,
+      20,  20,   0,   0,   0,   0,  20,  20,
+      20,  30,  10,   0,   0,  10,  30,  20}
+};
+static const int pst_pawn_eg[BOARD_SIZE * BOARD_SIZE] = {
+      0,   0,   0,   0,   0,   0,   0,   0,
+     80,  80,  80,  80,  80,  80,  80,  80,
+     50,  50,  50,  50,  50,  50,  50,  50,
+     30,  30,  30,  30,  30,  30,  30,  30,
+     20,  20,  20,  20,  20,  20,  20,  20,
+     10,  10,  10,  10,  10,  10,  10,  10,
+     10,  10,  10,  10,  10,  10,  10,  10,
+      0,   0,   0,   0,   0,   0,   0,   0
 };
+static const int pst_king_eg[BOARD_SIZE * BOARD_SIZE] = {
+    -50, -40, -30, -20, -20, -30, -40, -50,
+    -30, -20, -10,   0,   0, -10, -20, -30,
+    -30, -10,  20,  30,  30,  20, -10, -30,
+    -30, -10,  30,  40,  40,  30, -10, -30,
+    -30, -10,  30,  40,  40,  30, -10, -30,
+    -30, -10,  20,  30,  30,  20, -10, -30,
+    -30, -30,   0,   0,   0,   0, -30, -30,
+    -50, -30, -30, -30, -30, -30, -30, -50
+};
+
+// knight jumps and the eight king directions (first four are rook directions, last four bishop directions)
+static const int knight_offsets[8][2] = {{2, 1}, {2, -1}, {-2, 1}, {-2, -1}, {1, 2}, {1, -2}, {-1, 2}, {-1, -2}};
+static const int king_offsets[8][2] = {{1, 0}, {-1, 0}, {0, 1}, {0, -1}, {1, 1}, {-1, -1}, {1, -1}, {-1, 1}};
+
+// a null move (passing the turn) is stored in the search as a move from a square to itself
+#define IS_NULL_MOVE(move) ((move)->start_row == (move)->end_row && (move)->start_col == (move)->end_col)
+
+#define ON_BOARD(row, col) ((row) >= 0 && (row) < BOARD_SIZE && (col) >= 0 && (col) < BOARD_SIZE)
 
 // global variables for driver as well as user input and cpu/player color/checkmate and if game has been initialized
 static int num;
 static struct class* chessClass = NULL;
 static struct device* chessDevice = NULL;
-static char message[256] = {0}; 
+static char message[MESSAGE_SIZE] = {0}; 
 static char player[2] = {0}; 
 static char cpu[2] = {0};
 static size_t size = 0;  
 static struct chess_game game;
 static bool game_init = false;
 static bool checkmate = false;
+static struct search_context search_ctx;
+static struct analysis_job analysis;
+static struct ponder_job ponder;
+
+// zobrist keys indexed [piece + KING][square] (the EMPTY row stays 0) and for black to move
+// the transposition table is shared by every search and lives as long as the module, tt_mask is its size - 1
+static u64 zobrist_pieces[2 * KING + 1][BOARD_SIZE * BOARD_SIZE];
+static u64 zobrist_side;
+
+// the loaded network (NULL if none) and if it runs with avx2 (inside kernel_fpu_begin/end) or in plain C
+static struct nnue_net *nnue;
+static bool nnue_simd;
+
+// the pawn rows of zobrist_pieces, every other row 0, so the pawn key is updated the same way as the key
+static u64 zobrist_pawns[2 * KING + 1][BOARD_SIZE * BOARD_SIZE];
+
+// squares a knight or king attacks from every square, and every square along each of the king_offsets directions
+// up to the edge (a slider's attacks on an empty board)
+static u64 knight_attacks[BOARD_SIZE * BOARD_SIZE];
+static u64 king_attacks[BOARD_SIZE * BOARD_SIZE];
+static u64 ray_attacks[8][BOARD_SIZE * BOARD_SIZE];
+
+// material plus piece-square value of every signed piece (index piece + KING) on every square, in both phases,
+// black's negative so the sums are white's point of view, the EMPTY row is 0 like in zobrist_pieces
+static int psq_mg[KING * 2 + 1][BOARD_SIZE * BOARD_SIZE];
+static int psq_eg[KING * 2 + 1][BOARD_SIZE * BOARD_SIZE];
+
+// what every signed piece (index piece + KING) adds to the material key, 0 for kings and EMPTY
+static u64 material_keys[KING * 2 + 1];
+
+// one bit per kpk_index, set if white wins, built when the module loads (kpk_ready stays false if that failed)
+static u32 kpk_bitbase[KPK_INDEXES / 32];
+static bool kpk_ready;
+static struct tt_entry *tt;
+static unsigned long tt_mask;
+static u8 tt_generation;
+
+// static evaluations of the side to move, shared by every search like the transposition table, one word per slot:
+// the key with its low 16 bits replaced by the score, so a slot is written in one store and never read half written
+// eval_cache_mask is its size - 1, zobrist_network is mixed into the key of positions the network evaluated
+static u64 *eval_cache;
+static unsigned long eval_cache_mask;
+static u64 zobrist_network;
+
+// lazy smp helpers: their contexts are allocated on first use and kept, the threads only live for one search
+// helper_cpus is the parsed search_cpulist, the cpus the helper threads are bound to
+static struct search_context *helper_ctx[MAX_SEARCH_THREADS - 1];
+static struct task_struct *helper_tasks[MAX_SEARCH_THREADS - 1];
+static int helper_count;
+static struct cpumask helper_cpus;
+
+// ybwc state: one deque per thread (0 is the thread that started the search), the helpers waiting for work
+// and if the current search may split at all
+// idle helpers sleep on split_wait until split_generation (bumped by every new split point) moves on
+static struct split_deque split_deques[MAX_SEARCH_THREADS];
+static atomic_t idle_helpers = ATOMIC_INIT(0);
+static atomic_t split_generation = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(split_wait);
+static bool ybwc_active;
+
+// root splitting state: one work item per helper context (slot indexes helper_ctx), each taking root moves
+// from root_split (its next move, alpha, cutoff and best line) until none is left
+struct root_job {
+    struct work_struct work;
+    int slot;
+};
+static struct workqueue_struct *root_wq;
+static struct root_job root_jobs[MAX_SEARCH_THREADS - 1];
+static struct split_point root_split;
+static atomic_t root_pending;
+static DECLARE_COMPLETION(root_done);
+static bool root_active;
+
+// game_lock makes commands run one at a time and guards message, which a command builds its answer in
+// message_lock guards reply, what readers see: the last answer followed by whatever a running analysis appended
+// message_base is the read offset of reply[0]: every reply continues the stream of the one before it
+// so a reader that keeps the device open gets each new reply (or analysis line) just by reading again
+static DEFINE_MUTEX(game_lock);
+static DEFINE_MUTEX(message_lock);
+static char reply[MESSAGE_SIZE];
+static size_t reply_size;
+static loff_t message_base;
+
+// search depth used by 03 and the most plies any line may reach (quiescence included), used when a game starts
+static int search_depth = 6;
+module_param(search_depth, int, 0644);
+MODULE_PARM_DESC(search_depth, "Nominal depth of the cpu search in plies (default 6)");
+static int search_max_ply = 64;
+module_param(search_max_ply, int, 0644);
+MODULE_PARM_DESC(search_max_ply, "Most plies from the root, sets the size of the per-game search stack (default 64, at most 128)");
+static int search_movetime_ms = 1000;
+module_param(search_movetime_ms, int, 0644);
+MODULE_PARM_DESC(search_movetime_ms, "Hard time limit for a cpu move in milliseconds, 0 searches to search_depth (default 1000)");
+static unsigned long search_nodes;
+module_param(search_nodes, ulong, 0644);
+MODULE_PARM_DESC(search_nodes, "Search exactly this many nodes per cpu move instead of using the clock and search_depth, 0 disables (default 0)");
+static int search_threads = 1;
+module_param(search_threads, int, 0644);
+MODULE_PARM_DESC(search_threads, "Threads used by a cpu move or an analysis unless the command gives a count, not used with search_nodes (default 1)");
+static int search_smp_mode = SMP_LAZY;
+module_param(search_smp_mode, int, 0644);
+MODULE_PARM_DESC(search_smp_mode, "How helper threads search: 0 lazy smp (shared table only), 1 young brothers wait splitting with work stealing, 2 root moves spread over a workqueue (default 0)");
+static int ybwc_min_depth = 4;
+module_param(ybwc_min_depth, int, 0644);
+MODULE_PARM_DESC(ybwc_min_depth, "Smallest remaining depth at which a node's moves are shared in ybwc mode (default 4)");
+static int search_root_fanout = 4;
+module_param(search_root_fanout, int, 0644);
+MODULE_PARM_DESC(search_root_fanout, "Most root moves searched at once in root splitting mode, whatever the thread count asked for (default 4)");
+static char *search_cpulist = "";
+module_param(search_cpulist, charp, 0644);
+MODULE_PARM_DESC(search_cpulist, "CPUs the helper search threads are bound to, like 2-7, empty spreads them over every online cpu (default empty)");
+static bool search_ponder = true;
+module_param(search_ponder, bool, 0644);
+MODULE_PARM_DESC(search_ponder, "Keep searching on the expected player reply after a cpu move, not done with search_nodes (default on)");
+static int eval_cache_kb = 1024;
+module_param(eval_cache_kb, int, 0444);
+MODULE_PARM_DESC(eval_cache_kb, "Evaluation cache size in KiB, rounded down to a power of two entries, 0 disables it (default 1024)");
+static char *nnue_file = "";
+module_param(nnue_file, charp, 0444);
+MODULE_PARM_DESC(nnue_file, "Evaluation network loaded at module load through the firmware loader (a path under /lib/firmware), empty for none (default none)");
+static bool eval_nnue = true;
+module_param(eval_nnue, bool, 0644);
+MODULE_PARM_DESC(eval_nnue, "Evaluate with the network when one was loaded, taken at the start of each search (default on)");
+static int analysis_time_ms = 30000;
+module_param(analysis_time_ms, int, 0644);
+MODULE_PARM_DESC(analysis_time_ms, "Time limit of a 06 analysis in milliseconds, 0 runs it until the next command (default 30000)");
+static int mate_time_ms = 10000;
+module_param(mate_time_ms, int, 0644);
+MODULE_PARM_DESC(mate_time_ms, "Time limit of a 05 mate search in milliseconds, 0 searches until it is done (default 10000)");
+
+// search tuning, read once at load time when the reduction table is built
+// lmr_base and lmr_divisor are in hundredths: reduction = base + ln(depth) * ln(moves) / divisor
+static int lmr_base = 75;
+module_param(lmr_base, int, 0444);
+MODULE_PARM_DESC(lmr_base, "Late move reduction base in hundredths of a ply (default 75)");
+static int lmr_divisor = 225;
+module_param(lmr_divisor, int, 0444);
+MODULE_PARM_DESC(lmr_divisor, "Late move reduction divisor in hundredths (default 225)");
+static int lmr_min_depth = 3;
+module_param(lmr_min_depth, int, 0444);
+MODULE_PARM_DESC(lmr_min_depth, "Smallest depth at which late quiet moves are reduced (default 3)");
+static int lmr_min_moves = 3;
+module_param(lmr_min_moves, int, 0444);
+MODULE_PARM_DESC(lmr_min_moves, "Number of moves searched at full depth before reducing (default 3)");
+// reductions in plies by [depth][moves searched], built from the parameters above by search_init_reductions
+static int lmr_table[MAX_PLY][LMR_MOVES];
+static int null_move_reduction = 2;
+module_param(null_move_reduction, int, 0444);
+MODULE_PARM_DESC(null_move_reduction, "Null move depth reduction, one more ply is added every 6 plies of depth (default 2)");
+static int aspiration_window = 40;
+module_param(aspiration_window, int, 0644);
+MODULE_PARM_DESC(aspiration_window, "Half width of the root aspiration window around the previous score, 0 disables it (default 40)");
+static int tt_size_mb = 16;
+module_param(tt_size_mb, int, 0444);
+MODULE_PARM_DESC(tt_size_mb, "Transposition table size in MiB, rounded down to a power of two entries (default 16)");
+static int eval_lazy_margin = 400;
+module_param(eval_lazy_margin, int, 0644);
+MODULE_PARM_DESC(eval_lazy_margin, "Material and piece-square score this far outside the window ends the evaluation early, 0 disables it (default 400)");
 
 // functions critical for module as well as helper functions for game
 static int dev_open(struct inode *, struct file *); // opens module
 static int dev_release(struct inode *, struct file *); // closes module
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *); // reads from user input
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *); // writes to user input
+static ssize_t chess_command(char *cmd, size_t length); // runs one command and leaves its answer in message
 void board_init(void); // initializes chess board
 bool legal_move(int start_row, int start_col, int end_row, int end_col, int piece, char arr[4], char arr2[4]); // checks if user input legal
 bool clear_path(int start_row, int start_col, int end_row, int end_col, char arr[4]); // checks if path is clear (helper for legal_move)
@@ -68,9 +727,99 @@ int char_check(char c, const char *string); // checks if command is valid
 bool king_check(struct chess_game *game, int king_row, int king_col, char color); // checks if king is in check
 bool is_checkmate(struct chess_game *game, char arr[4], char arr2[4]); // checks if player or cpu is in checkmate (given turn)
 bool cpu_clear_path(int start_row, int start_col, int end_row, int end_col); // cpu algorithm for checking clear path
-void cpu_move(struct chess_game *game); // cpu algorithm for moving piece
+void cpu_move(struct chess_game *game, int threads); // cpu algorithm for moving piece
 bool cpu_checkmate(struct chess_game *game); // cpu algorithm for checking if in checkmate
 bool cpu_legal_move(int start_row, int start_col, int end_row, int end_col, int piece); // cpu algorithm which verifies cpu legal move
+void search_prepare(struct chess_game *game); // locates both kings and computes the key of a board copy before searching it
+int generate_moves(struct chess_game *game, struct cpu_move *moves, bool captures_only); // generates pseudo-legal moves for side to move
+bool square_attacked(struct chess_game *game, int row, int col, int side); // checks if side attacks the square
+bool in_check(struct chess_game *game, int side); // checks if side's king is attacked
+void make_move(struct chess_game *game, struct cpu_move *move, struct search_undo *undo); // plays a move on a search board
+void unmake_move(struct chess_game *game, struct cpu_move *move, struct search_undo *undo); // takes back a move played by make_move
+int least_valuable_attacker(struct chess_game *game, int row, int col, int side, int *attacker_row, int *attacker_col); // cheapest piece of side hitting a square
+int see(struct chess_game *game, struct cpu_move *move); // static exchange evaluation of a capture
+void score_moves(struct search_context *ctx, struct chess_game *game, struct cpu_move *moves, int count, int ply); // gives every move an ordering score
+bool same_move(struct cpu_move *a, struct cpu_move *b); // compares two moves ignoring their scores
+void update_quiet_stats(struct search_context *ctx, struct chess_game *game, struct cpu_move *move, int depth, int ply); // rewards a quiet move that caused a cutoff
+void search_age(struct search_context *ctx); // ages the ordering tables before a new cpu move
+int search_context_init(struct search_context *ctx); // allocates the search stack for a new game and clears the tables
+void search_clear_tables(struct search_context *ctx); // forgets everything the ordering tables learned
+u64 search_random(u64 *state); // next number from a xorshift generator
+void search_context_free(struct search_context *ctx); // releases the search stack
+void zobrist_init(void); // fills the zobrist keys from a fixed seed
+u64 search_hash(struct chess_game *game); // computes the zobrist key of a position from scratch
+u64 search_pawn_hash(struct chess_game *game); // computes the zobrist key of the pawns from scratch
+struct pawn_entry *pawn_probe(struct search_context *ctx, struct chess_game *game); // gets the pawn structure terms, from the cache if it has them
+int king_shield(struct pawn_entry *entry, int side, int king_row, int king_col); // scores the pawns in front of a king
+int king_safety(struct pawn_entry *pawns, struct eval_info *info, int side, int king_row, int king_col); // scores how exposed a king is
+struct material_entry *material_probe(struct search_context *ctx, struct chess_game *game); // gets the material terms, from the cache if it has them
+int endgame_kxk(struct chess_game *game, int strong); // scores a lone king against mating material
+int endgame_kbnk(struct chess_game *game, int strong); // scores a lone king against bishop and knight
+int endgame_kpk(struct chess_game *game, int strong); // scores king and pawn against king from the bitbase
+void kpk_init(void); // builds the king and pawn against king bitbase
+bool kpk_probe(int white_king, int black_king, int pawn, int side); // checks if white wins a king and pawn against king position
+int nnue_load(void); // loads the network named by nnue_file
+void nnue_free(void); // releases the network
+void nnue_refresh(struct chess_game *game, struct nnue_accumulator *accumulator, int side); // computes one side's first layer sums from scratch
+void nnue_make(struct chess_game *game, struct cpu_move *move, struct search_undo *undo); // updates the first layer sums for a move just made
+void nnue_attach(struct search_context *ctx, int ply); // puts ctx's board on its network stack at ply
+int nnue_evaluate(struct chess_game *game); // runs the network on a position
+u64 slider_attacks(int square, u64 occupied, int first, int last); // gets the squares a slider reaches along directions first to last
+void eval_pieces(struct chess_game *game, struct eval_info *info, int *mg, int *eg); // adds mobility and king zone attacks to the scores
+void eval_init(void); // builds the piece-square values of every signed piece and the attack tables
+void eval_compute(struct chess_game *game); // computes a board's running evaluation sums from scratch
+void eval_set(struct chess_game *game, int row, int col, int piece); // puts a piece on a square keeping the sums up to date
+int tt_init(void); // allocates the transposition table and the evaluation cache
+void tt_free(void); // releases the transposition table and the evaluation cache
+void tt_clear(void); // empties the transposition table and the evaluation cache
+bool tt_probe(u64 key, struct tt_entry *entry); // copies out the entry of key, false if there is none
+void tt_store(u64 key, int depth, int score, int bound, struct cpu_move *move, int ply); // stores a search result
+void tt_entry_move(struct tt_entry *entry, struct cpu_move *move); // unpacks the best move of an entry
+void tt_store_move(u64 key, struct cpu_move *move); // puts a move into the table without a score
+void tt_write(u64 key, struct tt_entry *entry); // writes an entry into the slot of key
+void search_save_expected(struct search_context *ctx); // keeps the pv beyond the next two plies for the following search
+bool search_restore_expected(struct search_context *ctx); // puts the kept pv back into the table if the game followed it
+void update_pv(struct search_context *ctx, int ply, struct cpu_move *move); // makes move followed by the child's line the pv of ply
+bool search_should_stop(struct search_context *ctx); // counts a node, yields now and then and reports if the search must stop
+bool search_aborted(struct search_context *ctx); // checks if the search has to give up the line it is on
+void search_start_deadline(struct search_context *ctx, int ms); // arms the timer that stops the search
+void search_cancel_deadline(struct search_context *ctx); // disarms the timer once the search is over
+void pick_move(struct cpu_move *moves, int count, int index); // swaps the best scored remaining move into index
+int search_evaluate(struct search_context *ctx, struct chess_game *game, int alpha, int beta); // scores the position for the side to move
+void search_init_reductions(void); // builds the late move reduction table from the module parameters
+bool has_non_pawn_material(struct chess_game *game, int side); // checks if side has anything besides king and pawns
+bool search_probe(struct search_context *ctx, int ply, int *score); // looks the node up in the transposition table, true if its bound ends the node
+bool search_try_move(struct search_context *ctx, int ply); // plays the next move of a node, false if it is illegal
+void search_enter(struct search_context *ctx, int ply, int depth, int alpha, int beta); // sets up a node for search_alphabeta
+int search_alphabeta(struct search_context *ctx, int depth, int alpha, int beta, int ply); // alpha-beta search of a position
+int search_root_moves(struct search_context *ctx, u64 seed); // generates, shuffles and orders the legal root moves, returns their count
+int search_root(struct search_context *ctx, int depth, int alpha, int beta, int first); // searches the root moves from first on once
+bool search_best_move(struct search_context *ctx, struct cpu_move *best, int movetime); // iterative deepening at the root, false if no legal move
+bool mate_attack(struct search_context *ctx, int plies, int ply); // checks if the attacker mates within plies using only checks
+bool mate_defend(struct search_context *ctx, int plies, int ply); // checks if every defence is mated within plies
+int mate_solve(struct search_context *ctx, int max_moves, int movetime); // finds the shortest forced mate up to max_moves, 0 if none, -1 if stopped
+void format_move(struct chess_game *game, struct cpu_move *move, char *buf); // writes a move in 02 command notation
+void format_line(struct chess_game *game, struct cpu_move *line, int length, char *buf, size_t size); // writes a line of moves from game's position
+bool analysis_start(int lines, int threads); // sets up the background analysis of the game, false if there is no legal move
+void analysis_stop(void); // stops the background analysis and waits for it
+void analysis_work(struct work_struct *work); // the analysis itself, runs on the unbound workqueue
+void analysis_publish(const char *text); // appends analysis output to the reply
+void ponder_start(struct chess_game *game, struct cpu_move *predicted); // starts pondering on game after the predicted player reply
+void ponder_stop(void); // stops pondering and throws its result away
+void ponder_work(struct work_struct *work); // the ponder search, runs on the unbound workqueue
+void ponder_player_moved(int start_row, int start_col, int end_row, int end_col, int piece); // keeps pondering only if the player played the prediction
+bool ponder_finish(struct cpu_move *best, bool *aged); // gets the cpu move from the ponder search after a hit, false if there is none
+int search_helpers_start(struct search_context *ctx, int threads); // starts helper threads on ctx's root, returns how many run
+void search_helpers_stop(void); // stops the helper threads and waits for them
+void search_helpers_free(void); // releases the helper contexts
+bool split_aborted(struct split_point *sp); // checks if a split point or one above it no longer needs its moves searched
+bool search_can_split(struct search_context *ctx, int depth); // checks if a node may share its moves with idle helpers
+int search_split(struct search_context *ctx, int depth, int alpha, int beta, int ply, int first); // searches a node's moves from first on with helpers
+void search_split_work(struct search_context *ctx, struct split_point *sp); // searches moves of a split point until none is left
+struct split_point *split_steal(struct search_context *ctx, struct split_point *below); // joins a split point offered by another thread
+void split_join(struct search_context *ctx, struct split_point *sp); // searches moves of a split point split_steal joined and leaves it
+void search_root_job(struct work_struct *work); // searches root moves for search_root_split on one helper context, runs on the root workqueue
+int search_root_split(struct search_context *ctx, int depth, int alpha, int beta, int first, int *best_index); // searches root moves from first on at once on the root workqueue
 
 
 // declares the pointers for module operations (read, write, open, release)
@@ -83,12 +832,38 @@ static struct file_operations fops = {
 
 // initializes the driver
 static int __init chess_init(void) {
+    int i;
+
     printk(KERN_INFO "initializing chess\n");
+    search_init_reductions();
+    zobrist_init();
+    eval_init();
+    kpk_init();
+    for (i = 0; i < MAX_SEARCH_THREADS; i++)
+        spin_lock_init(&split_deques[i].lock);
+    if (tt_init()) {
+        printk(KERN_ALERT "Chess failed to allocate the transposition table\n");
+        return -ENOMEM;
+    }
+    root_wq = alloc_workqueue("chess_root", WQ_UNBOUND, MAX_SEARCH_THREADS - 1);
+    if (!root_wq) {
+        printk(KERN_ALERT "Chess failed to allocate the root search workqueue\n");
+        tt_free();
+        return -ENOMEM;
+    }
+    for (i = 0; i < MAX_SEARCH_THREADS - 1; i++) {
+        root_jobs[i].slot = i;
+        INIT_WORK(&root_jobs[i].work, search_root_job);
+    }
+    INIT_WORK(&analysis.work, analysis_work);
+    INIT_WORK(&ponder.work, ponder_work);
     // initializing device
     num = register_chrdev(0, DEVICE_NAME, &fops);
     printk(KERN_INFO "num: %d\n", num);
     if (num < 0) {
         printk(KERN_ALERT "Chess failed to register num\n");
+        destroy_workqueue(root_wq);
+        tt_free();
         return num;
     }
 
@@ -97,6 +872,8 @@ static int __init chess_init(void) {
     if (IS_ERR(chessClass)) {
         unregister_chrdev(num, DEVICE_NAME);
         printk(KERN_ALERT "Failed to register device class\n");
+        destroy_workqueue(root_wq);
+        tt_free();
         return PTR_ERR(chessClass);
     }
 
@@ -106,15 +883,26 @@ static int __init chess_init(void) {
         class_destroy(chessClass);
         unregister_chrdev(num, DEVICE_NAME);
         printk(KERN_ALERT "Failed to create the device\n");
+        destroy_workqueue(root_wq);
+        tt_free();
         return PTR_ERR(chessDevice);
     }
 
     printk(KERN_INFO "Chess: Device class created correctly\n");
+    if (nnue_file[0])
+        nnue_load();
     return 0;
 }
 
 // destructing device and class and unregistering driver
 static void __exit chess_exit(void) {
+    analysis_stop();
+    ponder_stop();
+    search_context_free(&search_ctx);
+    search_helpers_free();
+    nnue_free();
+    destroy_workqueue(root_wq);
+    tt_free();
     device_destroy(chessClass, MKDEV(num, 0));
     class_destroy(chessClass);
     unregister_chrdev(num, DEVICE_NAME);
@@ -135,30 +923,37 @@ static int dev_release(struct inode *inodep, struct file *filep) {
 
 // outputs message read by driver to the user
 static ssize_t dev_read(struct file *filep, char *buffer, size_t length, loff_t *offset) {
-    size_t bytes_to_read = size - *offset;
+    size_t start;
+    size_t bytes_to_read;
+    ssize_t ret = -EFAULT;
+
+    if (mutex_lock_interruptible(&message_lock))
+        return -ERESTARTSYS;
+
+    // a fresh reader starts at the current reply, a reader that fell behind an analysis skips the lines it lost
+    if (*offset < message_base)
+        *offset = message_base;
+    start = *offset - message_base;
+    bytes_to_read = start < reply_size ? reply_size - start : 0;
 
     // if no bytes to read returns 0
     if (length > bytes_to_read)
         length = bytes_to_read;  
-    else if (bytes_to_read == 0) 
-        return 0;
 
-    if (copy_to_user(buffer, message + *offset, length) == 0) {
+    if (copy_to_user(buffer, reply + start, length) == 0) {
         *offset += length;  
-        return length;  
-    }else 
-        return -EFAULT;  
+        ret = length;  
+    }
+    mutex_unlock(&message_lock);
+    return ret;
 }
 
-// writes from user input
+// writes from user input, one command at a time
+// a running analysis is stopped first since every command may change the game or need the search,
+// pondering is only kept going through the player's move (02) and the cpu move after it (03)
 static ssize_t dev_write(struct file *filep, const char *buffer, size_t length, loff_t *offset) {
-    // initializing variables needed
-    int start_row;
-    int start_col;
-    int end_row;
-    int end_col;
     char cmd[256];
-    char piece;
+    ssize_t ret;
 
     // avoiding buffer overflow
     if (length > 255) 
@@ -169,7 +964,41 @@ static ssize_t dev_write(struct file *filep, const char *buffer, size_t length,
         return -EFAULT;
     else
         cmd[length] = '\0'; 
-    
+
+    if (mutex_lock_interruptible(&game_lock))
+        return -ERESTARTSYS;
+    analysis_stop();
+    if (cmd[0] != '0' || (cmd[1] != '2' && cmd[1] != '3'))
+        ponder_stop();
+
+    message[0] = '\0';
+    size = 0;
+    ret = chess_command(cmd, length);
+
+    // readers only wait for the copy, not for the command (which may be a whole cpu search)
+    // a new analysis is queued once its header is out so its lines always follow it
+    mutex_lock(&message_lock);
+    message_base += reply_size;
+    reply_size = min(size, sizeof(reply) - 1);
+    memcpy(reply, message, reply_size);
+    reply[reply_size] = '\0';
+    mutex_unlock(&message_lock);
+    if (analysis.running)
+        queue_work(system_unbound_wq, &analysis.work);
+
+    mutex_unlock(&game_lock);
+    return ret;
+}
+
+// runs a command from the user and leaves its answer in message, called by dev_write with game_lock held
+static ssize_t chess_command(char *cmd, size_t length) {
+    // initializing variables needed
+    int start_row;
+    int start_col;
+    int end_row;
+    int end_col;
+    char piece;
+
     printk(KERN_INFO "Chess command: %s\n", cmd);
 
     // switch cases for different command types: 00, 01, 02, 03, 04
@@ -182,6 +1011,13 @@ static ssize_t dev_write(struct file *filep, const char *buffer, size_t length,
                     cpu[0] = 'B';
                 else if (player[0] == 'B')
                     cpu[0] = 'W';
+                // the search stack is allocated once per game, without it there is no game
+                if (search_context_init(&search_ctx)) {
+                    game_init = false;
+                    strcpy(message, "NOMEM\n");
+                    size = strlen(message);
+                    return -ENOMEM;
+                }
                 board_init();  
                 strcpy(message, "New game\n");
                 size = strlen(message);
@@ -311,6 +1147,7 @@ static ssize_t dev_write(struct file *filep, const char *buffer, size_t length,
                 if (legal_move(start_row, start_col, end_row, end_col, piece, action1, action2)) {
                     temp = game;
                     perform_move(start_row, start_col, end_row, end_col, game.board[start_row][start_col]);
+                    ponder_player_moved(start_row, start_col, end_row, end_col, game.board[end_row][end_col]);
                     if (game.check == true && !is_checkmate(&temp, action1, action2)){
                         strcpy(message, "CHECK\n");
                         size = strlen(message);
@@ -329,6 +1166,8 @@ static ssize_t dev_write(struct file *filep, const char *buffer, size_t length,
                 }
             }else if (cmd[1] == '3'){
                 // cpu move, same conditions as 02 but much simpler
+                int threads;
+
                 // checking if game has been initialized OR checkmate or if cpu out of turn, else continue
                 if (game_init == false){
                     strcpy(message, "NOGAME\n");
@@ -351,7 +1190,10 @@ static ssize_t dev_write(struct file *filep, const char *buffer, size_t length,
                     break;
                 }
                 // performing the move, then checking for checkmate or check
-                cpu_move(&game);
+                // 03N uses N search threads instead of search_threads
+                threads = search_threads;
+                sscanf(cmd + 2, "%d", &threads);
+                cpu_move(&game, threads);
                 if (game.check == true && !cpu_checkmate(&game)){
                     strcpy(message, "CHECK\n");
                     size = strlen(message);
@@ -393,6 +1235,75 @@ static ssize_t dev_write(struct file *filep, const char *buffer, size_t length,
                 game_init = false;
                 strcpy(message, "OK\n");
                 size = strlen(message);
+            }else if (cmd[1] == '5'){
+                // mate in N solver for the side to move, 05N answers MATEIN followed by the mating line or NOMATE,
+                // or ABORTED if mate_time_ms ran out (or the node budget, or the writer was killed) before it could tell
+                int mate_moves;
+                int found;
+
+                if (game_init == false){
+                    strcpy(message, "NOGAME\n");
+                    size = strlen(message);
+                    break;
+                }
+                if (checkmate == true){
+                    strcpy(message, "MATE\n");
+                    size = strlen(message);
+                    break;
+                }
+                if (sscanf(cmd + 2, "%d", &mate_moves) != 1 || mate_moves < 1 || mate_moves > MAX_MATE_MOVES ||
+                    2 * mate_moves >= search_ctx.max_ply){
+                    strcpy(message, "INVFMT\n");
+                    size = strlen(message);
+                    break;
+                }
+
+                search_ctx.board = game;
+                search_prepare(&search_ctx.board);
+                found = mate_solve(&search_ctx, mate_moves, search_nodes > 0 ? 0 : mate_time_ms);
+                if (found > 0){
+                    size = snprintf(message, sizeof(message), "MATEIN %d ", found);
+                    format_line(&game, search_ctx.frames[0].pv, search_ctx.frames[0].pv_length, message + size, sizeof(message) - size);
+                    strlcat(message, "\n", sizeof(message));
+                }else if (found < 0){
+                    strcpy(message, "ABORTED\n");
+                }else{
+                    strcpy(message, "NOMATE\n");
+                }
+                size = strlen(message);
+            }else if (cmd[1] == '6'){
+                // multi-pv analysis of the current position, 06K searches the best K moves in the background
+                // every finished iteration is appended to the reply as K INFO lines and the end as a BESTMOVE line
+                // 060 (like any other command) stops a running analysis, 06K N uses N search threads
+                int lines;
+                int threads = search_threads;
+
+                if (sscanf(cmd + 2, "%d %d", &lines, &threads) < 1 || lines < 0 || lines > MAX_MULTIPV){
+                    strcpy(message, "INVFMT\n");
+                    size = strlen(message);
+                    break;
+                }
+                if (lines == 0){
+                    strcpy(message, "OK\n");
+                    size = strlen(message);
+                    break;
+                }
+                if (game_init == false){
+                    strcpy(message, "NOGAME\n");
+                    size = strlen(message);
+                    break;
+                }
+                if (checkmate == true){
+                    strcpy(message, "MATE\n");
+                    size = strlen(message);
+                    break;
+                }
+
+                size = snprintf(message, sizeof(message), "ANALYSIS %d\n", lines);
+                if (!analysis_start(lines, threads)){
+                    strcpy(message, "NOMOVES\n");
+                    size = strlen(message);
+                }
             }
             break;
     }
@@ -439,6 +1350,7 @@ void board_init(void) {
     game.current_turn = 1;
     game.check = false;
     checkmate = false;
+    eval_compute(&game);
 }
 
 
@@ -614,7 +1526,7 @@ bool legal_move(int start_row, int start_col, int end_row, int end_col, int piec
                         promotion *= 1; 
                         break;
                 }
-                game.board[start_row][start_col] = promotion;
+                eval_set(&game, start_row, start_col, promotion);
             // checking error cases of pawn promotion    
             }else if (isLegal && ((end_row == 7 && player[0] == 'W') || (end_row == 0 && player[0] == 'B')) && arr[0] == 'y' 
             && (arr[1] != player[0] || arr[2] == 'P' || arr[2] == 'K'))
@@ -718,7 +1630,7 @@ bool legal_move(int start_row, int start_col, int end_row, int end_col, int piec
                         promotion *= 1; 
                         break;
                 }
-                game.board[start_row][start_col] = promotion;
+                eval_set(&game, start_row, start_col, promotion);
                 
             // again checking command errors and then checking if playe ris putting themselve's in check
             }else if (isLegal && ((end_row == 7 && player[0] == 'W') || (end_row == 0 && player[0] == 'B')) && arr2[0] == 'y' && 
@@ -1042,9 +1954,9 @@ void perform_move(int start_row, int start_col, int end_row, int end_col, int pi
     int king_row;
     int king_col;
     captured_piece = game.board[end_row][end_col];
-    game.board[end_row][end_col] = piece;
+    eval_set(&game, end_row, end_col, piece);
 
-    game.board[start_row][start_col] = 0;
+    eval_set(&game, start_row, start_col, EMPTY);
 
     // getting opponent info for check
     if ((player[0] == 'W' || cpu[0] == 'W') && game.current_turn == 1)
@@ -1502,7 +2414,7 @@ bool cpu_legal_move(int start_row, int start_col, int end_row, int end_col, int
                         promotion *= 5;
                         break;
                 }
-                game.board[start_row][start_col] = promotion;  
+                eval_set(&game, start_row, start_col, promotion);  
             }
             if (beforeCheck){
                 bool inCheck;
@@ -1610,7 +2522,7 @@ bool cpu_legal_move(int start_row, int start_col, int end_row, int end_col, int
                         promotion *= 5;
                         break;
                 }
-                game.board[start_row][start_col] = promotion;  
+                eval_set(&game, start_row, start_col, promotion);  
             }
             if (beforeCheck){
                 bool inCheck;
@@ -1823,48 +2735,41 @@ bool cpu_legal_move(int start_row, int start_col, int end_row, int end_col, int
     return beforeCheck;
 }
 
-// checking for randomized cpu moves and performing them (not completely randomized to avoid infinite loop)
-void cpu_move(struct chess_game *game){
-    // declaring variables and array to store cpu moves
-    int i;
-    int j;
-    int k;
-    int l;
-    int piece;
-    unsigned int rand_val;
-    struct cpu_move legal_moves[BOARD_SIZE * BOARD_SIZE];
-    int counter;
-
-    counter = 0;
-
-    // traversing the board and choosing piece
-    for (i = 0; i < BOARD_SIZE; i++) {
-        for (j = 0; j < BOARD_SIZE; j++) {
-            piece = game->board[i][j];
-            // checking conditions so if it is a valid piece and not opponent piece
-            if ((cpu[0] == 'B' && piece < 0) || (cpu[0] == 'W' && piece > 0)) {
-                for (k = 0; k < BOARD_SIZE; k++) {
-                    for (l = 0; l < BOARD_SIZE; l++) {
-                        // traversing again to find legal moves and adding it to array (all legal moves possible)
-                        if (cpu_legal_move(i, j, k, l, piece)) {
-                            if (counter < sizeof(legal_moves)/sizeof(legal_moves[0])) {
-                                legal_moves[counter++] = (struct cpu_move){i, j, k, l};
-                            }
-                        }
-                    }
-                }
-            }
-        }
+// searching for the best cpu move and performing it
+void cpu_move(struct chess_game *game, int threads){
+    // the search works on its own copy so the game board is only touched by perform_move
+    struct cpu_move perform;
+    struct search_frame *root = &search_ctx.frames[0];
+    bool found;
+    bool aged;
+
+    // after a ponder hit the search already ran (or is finishing) on this position
+    found = ponder_finish(&perform, &aged);
+    if (!found) {
+        search_ctx.board = *game;
+        search_prepare(&search_ctx.board);
+        nnue_attach(&search_ctx, 0);
+
+        // a fixed node search starts from empty tables so the same position always gives the same move
+        // and after a ponder miss the tables were aged when pondering started
+        if (search_nodes > 0)
+            search_clear_tables(&search_ctx);
+        else if (!aged)
+            search_age(&search_ctx);
+        search_ctx.stop = false;
+        search_helpers_start(&search_ctx, threads);
+        found = search_best_move(&search_ctx, &perform, search_nodes > 0 ? 0 : search_movetime_ms);
+        search_helpers_stop();
     }
-    printk(KERN_INFO "counter: %d\n", counter);
-    // if there are legal moves, chooses one randomly and performs it
-    if (counter > 0) {
-        struct cpu_move perform;
-        get_random_bytes(&rand_val, sizeof(rand_val));
-        rand_val %= counter;
-        perform = legal_moves[rand_val];
-        perform_move(perform.start_row, perform.start_col, perform.end_row, perform.end_col, game->board[perform.start_row][perform.start_col]);
+
+    // if there are legal moves, performs the one the search liked best
+    // and ponders on the player reply the pv expects, as long as the pv starts with the move played
+    if (found) {
+        perform_move(perform.start_row, perform.start_col, perform.end_row, perform.end_col,
+                     perform.promotion ? perform.promotion : game->board[perform.start_row][perform.start_col]);
         printk(KERN_INFO "CPU moved piece from %d,%d to %d,%d\n", perform.start_row, perform.start_col, perform.end_row, perform.end_col);
+        if (search_ponder && search_nodes == 0 && root->pv_length >= 2 && same_move(&root->pv[0], &perform))
+            ponder_start(game, &root->pv[1]);
     } else {
         printk(KERN_INFO "No legal moves available\n");
     }
@@ -1923,6 +2828,2939 @@ bool cpu_checkmate(struct chess_game *game) {
     return true;
 }
 
+// locating both kings on the board copy, the search keeps them as [col, row] like board_init does, and computing its keys
+// the copy starts off any network stack, the search puts it on its own with nnue_attach
+void search_prepare(struct chess_game *game) {
+    int row;
+    int col;
+
+    for (row = 0; row < BOARD_SIZE; row++) {
+        for (col = 0; col < BOARD_SIZE; col++) {
+            if (game->board[row][col] == KING) {
+                game->white_king[0] = col;
+                game->white_king[1] = row;
+            } else if (game->board[row][col] == -KING) {
+                game->black_king[0] = col;
+                game->black_king[1] = row;
+            }
+        }
+    }
+    game->key = search_hash(game);
+    game->pawn_key = search_pawn_hash(game);
+    game->accumulator = NULL;
+}
+
+// adding a move to the list being generated
+static inline void add_move(struct cpu_move *moves, int *count, int start_row, int start_col, int end_row, int end_col, int promotion) {
+    moves[*count].start_row = start_row;
+    moves[*count].start_col = start_col;
+    moves[*count].end_row = end_row;
+    moves[*count].end_col = end_col;
+    moves[*count].promotion = promotion;
+    moves[*count].score = 0;
+    (*count)++;
+}
+
+// generating pseudo-legal moves for the side to move (the search checks the king afterwards)
+// pawns promote to a queen or a knight, captures_only keeps captures and queen promotions for quiescence
+int generate_moves(struct chess_game *game, struct cpu_move *moves, bool captures_only) {
+    int side = game->current_turn;
+    int count = 0;
+    int row;
+    int col;
+    int i;
+    int r;
+    int c;
+    int piece;
+    int target;
+    int last_row;
+    int first_dir;
+    int last_dir;
+    const int (*offsets)[2];
+
+    for (row = 0; row < BOARD_SIZE; row++) {
+        for (col = 0; col < BOARD_SIZE; col++) {
+            piece = game->board[row][col];
+            if (piece * side <= 0)
+                continue;
+
+            switch (abs(piece)) {
+                case PAWN:
+                    r = row + side;
+                    last_row = side > 0 ? BOARD_SIZE - 1 : 0;
+                    if (r < 0 || r >= BOARD_SIZE)
+                        break;
+                    // pushing forward one, or two from the starting row
+                    if (game->board[r][col] == EMPTY) {
+                        if (r == last_row) {
+                            add_move(moves, &count, row, col, r, col, side * QUEEN);
+                            if (!captures_only)
+                                add_move(moves, &count, row, col, r, col, side * KNIGHT);
+                        } else if (!captures_only) {
+                            add_move(moves, &count, row, col, r, col, 0);
+                            if (row == (side > 0 ? 1 : 6) && game->board[r + side][col] == EMPTY)
+                                add_move(moves, &count, row, col, r + side, col, 0);
+                        }
+                    }
+                    // capturing diagonally
+                    for (c = col - 1; c <= col + 1; c += 2) {
+                        if (c < 0 || c >= BOARD_SIZE || game->board[r][c] * side >= 0)
+                            continue;
+                        if (r == last_row) {
+                            add_move(moves, &count, row, col, r, c, side * QUEEN);
+                            if (!captures_only)
+                                add_move(moves, &count, row, col, r, c, side * KNIGHT);
+                        } else {
+                            add_move(moves, &count, row, col, r, c, 0);
+                        }
+                    }
+                    break;
+                case KNIGHT:
+                case KING:
+                    offsets = abs(piece) == KNIGHT ? knight_offsets : king_offsets;
+                    for (i = 0; i < 8; i++) {
+                        r = row + offsets[i][0];
+                        c = col + offsets[i][1];
+                        if (!ON_BOARD(r, c))
+                            continue;
+                        target = game->board[r][c];
+                        if ((target == EMPTY && !captures_only) || target * side < 0)
+                            add_move(moves, &count, row, col, r, c, 0);
+                    }
+                    break;
+                default:
+                    // sliding pieces walk each of their directions until something is in the way
+                    first_dir = abs(piece) == BISHOP ? 4 : 0;
+                    last_dir = abs(piece) == ROOK ? 4 : 8;
+                    for (i = first_dir; i < last_dir; i++) {
+                        r = row + king_offsets[i][0];
+                        c = col + king_offsets[i][1];
+                        while (ON_BOARD(r, c)) {
+                            target = game->board[r][c];
+                            if (target != EMPTY) {
+                                if (target * side < 0)
+                                    add_move(moves, &count, row, col, r, c, 0);
+                                break;
+                            }
+                            if (!captures_only)
+                                add_move(moves, &count, row, col, r, c, 0);
+                            r += king_offsets[i][0];
+                            c += king_offsets[i][1];
+                        }
+                    }
+                    break;
+            }
+        }
+    }
+    return count;
+}
+
+// checking if any piece of side attacks the square (side is 1 for white, -1 for black)
+bool square_attacked(struct chess_game *game, int row, int col, int side) {
+    int i;
+    int r;
+    int c;
+    int piece;
+
+    // pawns attack from the row behind the square (from side's point of view)
+    r = row - side;
+    if (r >= 0 && r < BOARD_SIZE) {
+        if (col > 0 && game->board[r][col - 1] == side * PAWN)
+            return true;
+        if (col < BOARD_SIZE - 1 && game->board[r][col + 1] == side * PAWN)
+            return true;
+    }
+
+    for (i = 0; i < 8; i++) {
+        r = row + knight_offsets[i][0];
+        c = col + knight_offsets[i][1];
+        if (ON_BOARD(r, c) && game->board[r][c] == side * KNIGHT)
+            return true;
+        r = row + king_offsets[i][0];
+        c = col + king_offsets[i][1];
+        if (ON_BOARD(r, c) && game->board[r][c] == side * KING)
+            return true;
+    }
+
+    // first piece along each line, rook directions come first in king_offsets
+    for (i = 0; i < 8; i++) {
+        r = row + king_offsets[i][0];
+        c = col + king_offsets[i][1];
+        while (ON_BOARD(r, c)) {
+            piece = game->board[r][c];
+            if (piece != EMPTY) {
+                if (piece == side * QUEEN || piece == side * (i < 4 ? ROOK : BISHOP))
+                    return true;
+                break;
+            }
+            r += king_offsets[i][0];
+            c += king_offsets[i][1];
+        }
+    }
+    return false;
+}
+
+// checking if the king of side is attacked on a search board
+bool in_check(struct chess_game *game, int side) {
+    if (side > 0)
+        return square_attacked(game, game->white_king[1], game->white_king[0], -side);
+    return square_attacked(game, game->black_king[1], game->black_king[0], -side);
+}
+
+// playing a move on a search board, unlike perform_move this does no check detection or printing
+void make_move(struct chess_game *game, struct cpu_move *move, struct search_undo *undo) {
+    undo->moved = game->board[move->start_row][move->start_col];
+    undo->captured = game->board[move->end_row][move->end_col];
+    undo->key = game->key;
+    undo->pawn_key = game->pawn_key;
+    undo->material = game->material;
+    undo->mg_score = game->mg_score;
+    undo->eg_score = game->eg_score;
+    undo->phase = game->phase;
+
+    game->board[move->end_row][move->end_col] = move->promotion ? move->promotion : undo->moved;
+    game->board[move->start_row][move->start_col] = EMPTY;
+    game->key ^= zobrist_pieces[undo->moved + KING][SQUARE(move->start_row, move->start_col)] ^
+                 zobrist_pieces[undo->captured + KING][SQUARE(move->end_row, move->end_col)] ^
+                 zobrist_pieces[game->board[move->end_row][move->end_col] + KING][SQUARE(move->end_row, move->end_col)] ^ zobrist_side;
+    game->pawn_key ^= zobrist_pawns[undo->moved + KING][SQUARE(move->start_row, move->start_col)] ^
+                      zobrist_pawns[undo->captured + KING][SQUARE(move->end_row, move->end_col)] ^
+                      zobrist_pawns[game->board[move->end_row][move->end_col] + KING][SQUARE(move->end_row, move->end_col)];
+    game->mg_score += psq_mg[game->board[move->end_row][move->end_col] + KING][SQUARE(move->end_row, move->end_col)] -
+                      psq_mg[undo->moved + KING][SQUARE(move->start_row, move->start_col)] -
+                      psq_mg[undo->captured + KING][SQUARE(move->end_row, move->end_col)];
+    game->eg_score += psq_eg[game->board[move->end_row][move->end_col] + KING][SQUARE(move->end_row, move->end_col)] -
+                      psq_eg[undo->moved + KING][SQUARE(move->start_row, move->start_col)] -
+                      psq_eg[undo->captured + KING][SQUARE(move->end_row, move->end_col)];
+    game->phase += phase_weight[abs(game->board[move->end_row][move->end_col])] - phase_weight[abs(undo->moved)] -
+                   phase_weight[abs(undo->captured)];
+    game->material += material_keys[game->board[move->end_row][move->end_col] + KING] - material_keys[undo->moved + KING] -
+                      material_keys[undo->captured + KING];
+
+    if (undo->moved == KING) {
+        game->white_king[0] = move->end_col;
+        game->white_king[1] = move->end_row;
+    } else if (undo->moved == -KING) {
+        game->black_king[0] = move->end_col;
+        game->black_king[1] = move->end_row;
+    }
+    if (game->accumulator)
+        nnue_make(game, move, undo);
+    game->current_turn = -game->current_turn;
+}
+
+// taking back a move played by make_move
+void unmake_move(struct chess_game *game, struct cpu_move *move, struct search_undo *undo) {
+    game->current_turn = -game->current_turn;
+    if (game->accumulator)
+        game->accumulator--;
+    game->key = undo->key;
+    game->pawn_key = undo->pawn_key;
+    game->material = undo->material;
+    game->mg_score = undo->mg_score;
+    game->eg_score = undo->eg_score;
+    game->phase = undo->phase;
+    game->board[move->start_row][move->start_col] = undo->moved;
+    game->board[move->end_row][move->end_col] = undo->captured;
+
+    if (undo->moved == KING) {
+        game->white_king[0] = move->start_col;
+        game->white_king[1] = move->start_row;
+    } else if (undo->moved == -KING) {
+        game->black_king[0] = move->start_col;
+        game->black_king[1] = move->start_row;
+    }
+}
+
+// finding the cheapest piece of side that attacks the square, returns its type (0 if none) and where it stands
+int least_valuable_attacker(struct chess_game *game, int row, int col, int side, int *attacker_row, int *attacker_col) {
+    int best = 0;
+    int i;
+    int r;
+    int c;
+    int piece;
+
+    r = row - side;
+    if (r >= 0 && r < BOARD_SIZE) {
+        for (c = col - 1; c <= col + 1; c += 2) {
+            if (c >= 0 && c < BOARD_SIZE && game->board[r][c] == side * PAWN) {
+                *attacker_row = r;
+                *attacker_col = c;
+                return PAWN;
+            }
+        }
+    }
+
+    for (i = 0; i < 8; i++) {
+        r = row + knight_offsets[i][0];
+        c = col + knight_offsets[i][1];
+        if (ON_BOARD(r, c) && game->board[r][c] == side * KNIGHT) {
+            *attacker_row = r;
+            *attacker_col = c;
+            return KNIGHT;
+        }
+    }
+
+    // bishops, rooks and queens, the enum order matches their value order
+    for (i = 0; i < 8; i++) {
+        r = row + king_offsets[i][0];
+        c = col + king_offsets[i][1];
+        while (ON_BOARD(r, c)) {
+            piece = game->board[r][c];
+            if (piece != EMPTY) {
+                if (piece * side > 0 && (abs(piece) == QUEEN || abs(piece) == (i < 4 ? ROOK : BISHOP)) &&
+                    (best == 0 || abs(piece) < best)) {
+                    best = abs(piece);
+                    *attacker_row = r;
+                    *attacker_col = c;
+                }
+                break;
+            }
+            r += king_offsets[i][0];
+            c += king_offsets[i][1];
+        }
+    }
+    if (best)
+        return best;
+
+    for (i = 0; i < 8; i++) {
+        r = row + king_offsets[i][0];
+        c = col + king_offsets[i][1];
+        if (ON_BOARD(r, c) && game->board[r][c] == side * KING) {
+            *attacker_row = r;
+            *attacker_col = c;
+            return KING;
+        }
+    }
+    return 0;
+}
+
+// static exchange evaluation: material won or lost if both sides keep recapturing on the target square
+// attackers are lifted off the board as they capture so pieces behind them join in, then put back
+int see(struct chess_game *game, struct cpu_move *move) {
+    int gain[32];
+    int lifted[32][3];
+    int lifted_count = 0;
+    int depth = 0;
+    int side;
+    int occupant;
+    int attacker;
+    int row;
+    int col;
+
+    gain[0] = piece_value[abs(game->board[move->end_row][move->end_col])];
+    occupant = abs(game->board[move->start_row][move->start_col]);
+    side = game->board[move->start_row][move->start_col] > 0 ? -1 : 1;
+
+    lifted[0][0] = move->start_row;
+    lifted[0][1] = move->start_col;
+    lifted[0][2] = game->board[move->start_row][move->start_col];
+    lifted_count = 1;
+    game->board[move->start_row][move->start_col] = EMPTY;
+
+    while (depth < 31) {
+        attacker = least_valuable_attacker(game, move->end_row, move->end_col, side, &row, &col);
+        if (!attacker)
+            break;
+        depth++;
+        gain[depth] = piece_value[occupant] - gain[depth - 1];
+        // neither side can come out ahead by continuing
+        if (max(-gain[depth - 1], gain[depth]) < 0)
+            break;
+        lifted[lifted_count][0] = row;
+        lifted[lifted_count][1] = col;
+        lifted[lifted_count][2] = game->board[row][col];
+        lifted_count++;
+        game->board[row][col] = EMPTY;
+        occupant = attacker;
+        side = -side;
+    }
+
+    // either side may stop recapturing when it would lose by going on
+    while (depth > 0) {
+        gain[depth - 1] = -max(-gain[depth - 1], gain[depth]);
+        depth--;
+    }
+
+    while (lifted_count > 0) {
+        lifted_count--;
+        game->board[lifted[lifted_count][0]][lifted[lifted_count][1]] = lifted[lifted_count][2];
+    }
+    return gain[0];
+}
+
+// scoring moves for ordering: captures by most valuable victim / least valuable attacker, queen promotions with them,
+// then killers, the countermove and history for quiet moves, and captures that lose material by SEE last
+void score_moves(struct search_context *ctx, struct chess_game *game, struct cpu_move *moves, int count, int ply) {
+    struct cpu_move *counter = NULL;
+    struct cpu_move *previous;
+    int side = SIDE_INDEX(game->current_turn);
+    int i;
+    int victim;
+    int attacker;
+    int mvv_lva;
+
+    previous = ply > 0 ? &ctx->frames[ply - 1].move : NULL;
+    if (previous && !IS_NULL_MOVE(previous)) {
+        counter = &ctx->countermoves[game->board[previous->end_row][previous->end_col] + KING]
+                                    [SQUARE(previous->end_row, previous->end_col)];
+    }
+
+    for (i = 0; i < count; i++) {
+        if (same_move(&moves[i], &ctx->frames[ply].hash_move)) {
+            moves[i].score = HASH_MOVE_SCORE;
+            continue;
+        }
+        victim = abs(game->board[moves[i].end_row][moves[i].end_col]);
+        attacker = abs(game->board[moves[i].start_row][moves[i].start_col]);
+
+        if (victim == EMPTY && abs(moves[i].promotion) != QUEEN) {
+            if (same_move(&moves[i], &ctx->frames[ply].killers[0]))
+                moves[i].score = KILLER1_SCORE;
+            else if (same_move(&moves[i], &ctx->frames[ply].killers[1]))
+                moves[i].score = KILLER2_SCORE;
+            else if (counter && same_move(&moves[i], counter))
+                moves[i].score = COUNTERMOVE_SCORE;
+            else
+                moves[i].score = ctx->history[side][SQUARE(moves[i].start_row, moves[i].start_col)]
+                                                   [SQUARE(moves[i].end_row, moves[i].end_col)];
+            continue;
+        }
+
+        mvv_lva = victim * 8 - attacker;
+        if (moves[i].promotion)
+            mvv_lva += abs(moves[i].promotion) * 8;
+
+        // a capture of an equal or bigger piece can never lose material so SEE is only needed otherwise
+        if (victim != EMPTY && piece_value[victim] < piece_value[attacker] && see(game, &moves[i]) < 0)
+            moves[i].score = BAD_CAPTURE_SCORE + mvv_lva;
+        else
+            moves[i].score = GOOD_CAPTURE_SCORE + mvv_lva;
+    }
+}
+
+// comparing two moves, scores are ignored
+bool same_move(struct cpu_move *a, struct cpu_move *b) {
+    return a->start_row == b->start_row && a->start_col == b->start_col && a->end_row == b->end_row &&
+           a->end_col == b->end_col && a->promotion == b->promotion;
+}
+
+// rewarding a quiet move that caused a beta cutoff: it becomes the first killer of its ply, gains history
+// and is remembered as the reply to the move before it
+void update_quiet_stats(struct search_context *ctx, struct chess_game *game, struct cpu_move *move, int depth, int ply) {
+    struct cpu_move *previous;
+    struct cpu_move *killers = ctx->frames[ply].killers;
+    int *history;
+    int side = SIDE_INDEX(game->current_turn);
+    int i;
+    int j;
+
+    if (!same_move(move, &killers[0])) {
+        killers[1] = killers[0];
+        killers[0] = *move;
+    }
+
+    history = &ctx->history[side][SQUARE(move->start_row, move->start_col)][SQUARE(move->end_row, move->end_col)];
+    *history += depth * depth;
+    if (*history > HISTORY_MAX) {
+        for (i = 0; i < BOARD_SIZE * BOARD_SIZE; i++) {
+            for (j = 0; j < BOARD_SIZE * BOARD_SIZE; j++)
+                ctx->history[side][i][j] /= 2;
+        }
+    }
+
+    previous = ply > 0 ? &ctx->frames[ply - 1].move : NULL;
+    if (previous && !IS_NULL_MOVE(previous)) {
+        ctx->countermoves[game->board[previous->end_row][previous->end_col] + KING]
+                         [SQUARE(previous->end_row, previous->end_col)] = *move;
+    }
+}
+
+// aging the ordering tables between cpu moves instead of clearing them
+// two plies were played since the last search so killers move up two plies, and history is halved
+// the transposition table is kept, a new generation just lets its old entries be replaced first
+void search_age(struct search_context *ctx) {
+    int side;
+    int i;
+    int j;
+
+    for (i = 0; i < ctx->max_ply; i++) {
+        if (i + 2 < ctx->max_ply)
+            memcpy(ctx->frames[i].killers, ctx->frames[i + 2].killers, sizeof(ctx->frames[i].killers));
+        else
+            memset(ctx->frames[i].killers, 0, sizeof(ctx->frames[i].killers));
+    }
+
+    for (side = 0; side < 2; side++) {
+        for (i = 0; i < BOARD_SIZE * BOARD_SIZE; i++) {
+            for (j = 0; j < BOARD_SIZE * BOARD_SIZE; j++)
+                ctx->history[side][i][j] /= 2;
+        }
+    }
+    tt_generation++;
+}
+
+// getting the search ready for a new game: the frames are (re)allocated only if search_max_ply changed
+// and the ordering tables start out empty
+// the new frames are allocated before the old ones are released, so a failure leaves ctx as it was
+int search_context_init(struct search_context *ctx) {
+    int max_ply = clamp(search_max_ply, 8, MAX_PLY);
+    struct search_frame *frames;
+    struct nnue_accumulator *accumulators = NULL;
+
+    if (!ctx->frames || ctx->max_ply != max_ply) {
+        frames = vzalloc(array_size(max_ply, sizeof(*frames)));
+        if (!frames)
+            return -ENOMEM;
+        if (nnue) {
+            accumulators = vmalloc(array_size(max_ply + 1, sizeof(*accumulators)));
+            if (!accumulators) {
+                vfree(frames);
+                return -ENOMEM;
+            }
+        }
+        search_context_free(ctx);
+        ctx->frames = frames;
+        ctx->accumulators = accumulators;
+        ctx->max_ply = max_ply;
+    } else {
+        memset(ctx->frames, 0, array_size(max_ply, sizeof(*ctx->frames)));
+    }
+    search_clear_tables(ctx);
+    return 0;
+}
+
+// clearing killers, history, countermoves, the expected pv and the transposition table, done for every search in fixed node mode so results only depend on the position
+void search_clear_tables(struct search_context *ctx) {
+    int i;
+
+    for (i = 0; i < ctx->max_ply; i++)
+        memset(ctx->frames[i].killers, 0, sizeof(ctx->frames[i].killers));
+    memset(ctx->history, 0, sizeof(ctx->history));
+    memset(ctx->countermoves, 0, sizeof(ctx->countermoves));
+    ctx->expected_length = 0;
+    tt_clear();
+}
+
+// xorshift64* generator, the state must not be 0
+u64 search_random(u64 *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+// releasing the search stack
+void search_context_free(struct search_context *ctx) {
+    vfree(ctx->frames);
+    ctx->frames = NULL;
+    vfree(ctx->accumulators);
+    ctx->accumulators = NULL;
+    ctx->max_ply = 0;
+}
+
+// counting a node and, every SEARCH_CHECK_NODES nodes, letting other tasks run and checking if the writer is being killed
+// a long search runs inside dev_write so without this it would hold the cpu until it finished
+// a thread searching a move of a split point gives it up (cut) once that split point or one above it is aborted
+bool search_should_stop(struct search_context *ctx) {
+    ctx->nodes++;
+    if (ctx->split && split_aborted(ctx->split))
+        ctx->cut = true;
+    if (ctx->node_limit && ctx->nodes >= ctx->node_limit)
+        ctx->stop = true;
+    if ((ctx->nodes & (SEARCH_CHECK_NODES - 1)) == 0) {
+        cond_resched();
+        if (fatal_signal_pending(current))
+            ctx->stop = true;
+    }
+    return search_aborted(ctx);
+}
+
+// a search that was stopped or cut off below a split point returns at once without storing anything
+bool search_aborted(struct search_context *ctx) {
+    return READ_ONCE(ctx->stop) || ctx->cut;
+}
+
+// the deadline timer only raises the stop flag, the search notices it on its next node
+static enum hrtimer_restart search_deadline_expired(struct hrtimer *timer) {
+    struct search_context *ctx = container_of(timer, struct search_context, deadline);
+
+    WRITE_ONCE(ctx->stop, true);
+    return HRTIMER_NORESTART;
+}
+
+// arming a high resolution timer for the search so it never has to read the clock itself
+void search_start_deadline(struct search_context *ctx, int ms) {
+    hrtimer_init(&ctx->deadline, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ctx->deadline.function = search_deadline_expired;
+    hrtimer_start(&ctx->deadline, ms_to_ktime(ms), HRTIMER_MODE_REL);
+}
+
+// disarming the timer, waits for the callback if it is running right now
+void search_cancel_deadline(struct search_context *ctx) {
+    hrtimer_cancel(&ctx->deadline);
+}
+
+// zobrist keys come from a fixed seed so a position hashes the same way on every load of the module
+void zobrist_init(void) {
+    u64 state = 0x9e3779b97f4a7c15ULL;
+    int piece;
+    int square;
+
+    for (piece = -KING; piece <= KING; piece++) {
+        for (square = 0; square < BOARD_SIZE * BOARD_SIZE; square++) {
+            zobrist_pieces[piece + KING][square] = piece == EMPTY ? 0 : search_random(&state);
+            zobrist_pawns[piece + KING][square] = abs(piece) == PAWN ? zobrist_pieces[piece + KING][square] : 0;
+        }
+    }
+    zobrist_side = search_random(&state);
+    zobrist_network = search_random(&state);
+}
+
+// xor of the keys of every piece on its square, and of zobrist_side if black is to move
+u64 search_hash(struct chess_game *game) {
+    u64 key = game->current_turn < 0 ? zobrist_side : 0;
+    int row;
+    int col;
+
+    for (row = 0; row < BOARD_SIZE; row++) {
+        for (col = 0; col < BOARD_SIZE; col++)
+            key ^= zobrist_pieces[game->board[row][col] + KING][SQUARE(row, col)];
+    }
+    return key;
+}
+
+// xor of the keys of every pawn on its square
+u64 search_pawn_hash(struct chess_game *game) {
+    u64 key = 0;
+    int row;
+    int col;
+
+    for (row = 0; row < BOARD_SIZE; row++) {
+        for (col = 0; col < BOARD_SIZE; col++)
+            key ^= zobrist_pawns[game->board[row][col] + KING][SQUARE(row, col)];
+    }
+    return key;
+}
+
+// allocating tt_size_mb of entries (rounded down to a power of two so the key can be masked into an index)
+// and eval_cache_kb of evaluation cache slots the same way, none if it is 0
+int tt_init(void) {
+    unsigned long count = (unsigned long)max(tt_size_mb, 1) * 1024 * 1024 / sizeof(struct tt_entry);
+
+    count = rounddown_pow_of_two(count);
+    tt = vzalloc(array_size(count, sizeof(*tt)));
+    if (!tt)
+        return -ENOMEM;
+    tt_mask = count - 1;
+    printk(KERN_INFO "Chess: transposition table of %lu entries\n", count);
+
+    count = (unsigned long)max(eval_cache_kb, 0) * 1024 / sizeof(*eval_cache);
+    if (count == 0)
+        return 0;
+    count = rounddown_pow_of_two(count);
+    eval_cache = vzalloc(array_size(count, sizeof(*eval_cache)));
+    if (!eval_cache) {
+        tt_free();
+        return -ENOMEM;
+    }
+    eval_cache_mask = count - 1;
+    printk(KERN_INFO "Chess: evaluation cache of %lu entries\n", count);
+    return 0;
+}
+
+// releasing the transposition table and the evaluation cache
+void tt_free(void) {
+    vfree(tt);
+    tt = NULL;
+    vfree(eval_cache);
+    eval_cache = NULL;
+}
+
+// emptying the transposition table and the evaluation cache for a new game
+void tt_clear(void) {
+    memset(tt, 0, array_size(tt_mask + 1, sizeof(*tt)));
+    tt_generation = 0;
+    if (eval_cache)
+        memset(eval_cache, 0, array_size(eval_cache_mask + 1, sizeof(*eval_cache)));
+}
+
+// copying out the entry of key, false if its slot holds another position
+// an entry may only hold a move (TT_NONE, depth 0) which never ends a node
+bool tt_probe(u64 key, struct tt_entry *entry) {
+    struct tt_entry *slot = &tt[key & tt_mask];
+
+    entry->data = READ_ONCE(slot->data);
+    entry->key = READ_ONCE(slot->key) ^ entry->data;
+    return entry->key == key;
+}
+
+// writing both words of a slot, see struct tt_entry for why the key is stored xored with the data
+void tt_write(u64 key, struct tt_entry *entry) {
+    struct tt_entry *slot = &tt[key & tt_mask];
+
+    WRITE_ONCE(slot->data, entry->data);
+    WRITE_ONCE(slot->key, key ^ entry->data);
+}
+
+// storing a search result, mate scores are made relative to this node so they stay right at any ply
+// a deeper entry of the current search for another position is kept, anything else is replaced
+// without a move the one already stored for the position is kept
+void tt_store(u64 key, int depth, int score, int bound, struct cpu_move *move, int ply) {
+    struct tt_entry entry;
+    bool found = tt_probe(key, &entry);
+
+    if (!found && entry.generation == tt_generation && entry.depth > depth)
+        return;
+    if (score >= MATE_SCORE - MAX_PLY)
+        score += ply;
+    else if (score <= -MATE_SCORE + MAX_PLY)
+        score -= ply;
+
+    if (move) {
+        entry.start = SQUARE(move->start_row, move->start_col);
+        entry.end = SQUARE(move->end_row, move->end_col);
+        entry.promotion = move->promotion;
+    } else if (!found) {
+        entry.start = 0;
+        entry.end = 0;
+        entry.promotion = 0;
+    }
+    entry.score = score;
+    entry.depth = depth;
+    entry.bound = bound;
+    entry.generation = tt_generation;
+    tt_write(key, &entry);
+}
+
+// unpacking the best move of an entry, an entry without one gives a null move which never matches a real move
+void tt_entry_move(struct tt_entry *entry, struct cpu_move *move) {
+    move->start_row = entry->start / BOARD_SIZE;
+    move->start_col = entry->start % BOARD_SIZE;
+    move->end_row = entry->end / BOARD_SIZE;
+    move->end_col = entry->end % BOARD_SIZE;
+    move->promotion = entry->promotion;
+    move->score = 0;
+}
+
+// a move without a score, used to put a remembered pv back: the entry of the position only gets the move,
+// another position's entry is only taken over if it is from an older search
+void tt_store_move(u64 key, struct cpu_move *move) {
+    struct tt_entry entry;
+
+    if (!tt_probe(key, &entry)) {
+        if (entry.generation == tt_generation && entry.bound != TT_NONE)
+            return;
+        entry.score = 0;
+        entry.depth = 0;
+        entry.bound = TT_NONE;
+        entry.generation = tt_generation;
+    }
+    entry.start = SQUARE(move->start_row, move->start_col);
+    entry.end = SQUARE(move->end_row, move->end_col);
+    entry.promotion = move->promotion;
+    tt_write(key, &entry);
+}
+
+// after a search the pv goes cpu move, expected reply, then the line the next search will most likely look at first
+// that part is kept with the key of the position after the first two moves
+void search_save_expected(struct search_context *ctx) {
+    struct search_frame *frame = &ctx->frames[0];
+    struct search_undo undo[2];
+
+    ctx->expected_length = 0;
+    if (frame->pv_length <= 2)
+        return;
+    make_move(&ctx->board, &frame->pv[0], &undo[0]);
+    make_move(&ctx->board, &frame->pv[1], &undo[1]);
+    ctx->expected_key = ctx->board.key;
+    unmake_move(&ctx->board, &frame->pv[1], &undo[1]);
+    unmake_move(&ctx->board, &frame->pv[0], &undo[0]);
+
+    ctx->expected_length = frame->pv_length - 2;
+    memcpy(ctx->expected, &frame->pv[2], ctx->expected_length * sizeof(*ctx->expected));
+}
+
+// if the game followed the pv, its moves are put back into the transposition table along the line
+// (other entries may have replaced them) so every ply of it is searched first again
+// the frames' undo slots are free before a search and hold the line while it is played out
+bool search_restore_expected(struct search_context *ctx) {
+    struct chess_game *game = &ctx->board;
+    int i;
+
+    if (ctx->expected_length == 0 || game->key != ctx->expected_key)
+        return false;
+    for (i = 0; i < ctx->expected_length; i++) {
+        tt_store_move(game->key, &ctx->expected[i]);
+        make_move(game, &ctx->expected[i], &ctx->frames[i].undo);
+    }
+    while (i-- > 0)
+        unmake_move(game, &ctx->expected[i], &ctx->frames[i].undo);
+    return true;
+}
+
+// the pv of ply becomes move followed by the pv of the ply below
+void update_pv(struct search_context *ctx, int ply, struct cpu_move *move) {
+    struct search_frame *frame = &ctx->frames[ply];
+    struct search_frame *child = &ctx->frames[ply + 1];
+
+    frame->pv[0] = *move;
+    memcpy(&frame->pv[1], child->pv, child->pv_length * sizeof(*child->pv));
+    frame->pv_length = child->pv_length + 1;
+}
+
+// selecting the best scored move from index onwards and swapping it into index
+void pick_move(struct cpu_move *moves, int count, int index) {
+    int i;
+    int best = index;
+    struct cpu_move temp;
+
+    for (i = index + 1; i < count; i++) {
+        if (moves[i].score > moves[best].score)
+            best = i;
+    }
+    if (best != index) {
+        temp = moves[index];
+        moves[index] = moves[best];
+        moves[best] = temp;
+    }
+}
+
+// natural log in 1/1024 units, log2 is interpolated linearly between powers of two
+static int fixed_ln(int x) {
+    int whole = ilog2(x);
+    return (((whole << 10) + ((x << 10) >> whole) - 1024) * 710) >> 10;
+}
+
+// building the late move reduction table from the module parameters (in plies)
+void search_init_reductions(void) {
+    int depth;
+    int moves;
+    int product;
+    int divisor = max(lmr_divisor, 1);
+
+    for (depth = 1; depth < MAX_PLY; depth++) {
+        for (moves = 1; moves < LMR_MOVES; moves++) {
+            product = (fixed_ln(depth) * fixed_ln(moves)) >> 10;
+            lmr_table[depth][moves] = max(lmr_base + product * 100 / divisor * 100 / 1024, 0) / 100;
+        }
+    }
+}
+
+// checking if side still has a knight, bishop, rook or queen (null moves are unsafe in pawn endings because of zugzwang)
+// read from the counts of the material key
+bool has_non_pawn_material(struct chess_game *game, int side) {
+    return game->material & (0xffffULL << MATERIAL_SHIFT(SIDE_INDEX(side), KNIGHT));
+}
+
+// the piece-square tables are written rank 8 first, so white's square (row, col) is entry (7 - row, col) and black's is (row, col)
+// the attack tables step once from every square for knights and kings and to the edge for rays
+void eval_init(void) {
+    const int *eg;
+    int piece;
+    int row;
+    int col;
+    int white;
+    int black;
+    int i;
+    int r;
+    int c;
+
+    for (row = 0; row < BOARD_SIZE; row++) {
+        for (col = 0; col < BOARD_SIZE; col++) {
+            for (i = 0; i < 8; i++) {
+                if (ON_BOARD(row + knight_offsets[i][0], col + knight_offsets[i][1]))
+                    knight_attacks[SQUARE(row, col)] |= 1ULL << SQUARE(row + knight_offsets[i][0], col + knight_offsets[i][1]);
+                if (ON_BOARD(row + king_offsets[i][0], col + king_offsets[i][1]))
+                    king_attacks[SQUARE(row, col)] |= 1ULL << SQUARE(row + king_offsets[i][0], col + king_offsets[i][1]);
+                for (r = row + king_offsets[i][0], c = col + king_offsets[i][1]; ON_BOARD(r, c); r += king_offsets[i][0], c += king_offsets[i][1])
+                    ray_attacks[i][SQUARE(row, col)] |= 1ULL << SQUARE(r, c);
+            }
+        }
+    }
+
+    for (piece = PAWN; piece <= KING; piece++) {
+        eg = piece == PAWN ? pst_pawn_eg : piece == KING ? pst_king_eg : pst[piece];
+        for (row = 0; row < BOARD_SIZE; row++) {
+            for (col = 0; col < BOARD_SIZE; col++) {
+                white = SQUARE(BOARD_SIZE - 1 - row, col);
+                black = SQUARE(row, col);
+                psq_mg[KING + piece][SQUARE(row, col)] = material_mg[piece] + pst[piece][white];
+                psq_eg[KING + piece][SQUARE(row, col)] = material_eg[piece] + eg[white];
+                psq_mg[KING - piece][SQUARE(row, col)] = -(material_mg[piece] + pst[piece][black]);
+                psq_eg[KING - piece][SQUARE(row, col)] = -(material_eg[piece] + eg[black]);
+            }
+        }
+        if (piece != KING) {
+            material_keys[KING + piece] = 1ULL << MATERIAL_SHIFT(SIDE_INDEX(1), piece);
+            material_keys[KING - piece] = 1ULL << MATERIAL_SHIFT(SIDE_INDEX(-1), piece);
+        }
+    }
+}
+
+// summing every piece's value, only needed when a board is set up, moves keep the sums up to date after that
+void eval_compute(struct chess_game *game) {
+    int row;
+    int col;
+
+    game->mg_score = 0;
+    game->eg_score = 0;
+    game->phase = 0;
+    game->material = 0;
+    for (row = 0; row < BOARD_SIZE; row++) {
+        for (col = 0; col < BOARD_SIZE; col++) {
+            game->mg_score += psq_mg[game->board[row][col] + KING][SQUARE(row, col)];
+            game->eg_score += psq_eg[game->board[row][col] + KING][SQUARE(row, col)];
+            game->phase += phase_weight[abs(game->board[row][col])];
+            game->material += material_keys[game->board[row][col] + KING];
+        }
+    }
+}
+
+// replacing whatever stands on a square of the game board (EMPTY clears it), for the changes made outside make_move
+void eval_set(struct chess_game *game, int row, int col, int piece) {
+    game->mg_score += psq_mg[piece + KING][SQUARE(row, col)] - psq_mg[game->board[row][col] + KING][SQUARE(row, col)];
+    game->eg_score += psq_eg[piece + KING][SQUARE(row, col)] - psq_eg[game->board[row][col] + KING][SQUARE(row, col)];
+    game->phase += phase_weight[abs(piece)] - phase_weight[abs(game->board[row][col])];
+    game->material += material_keys[piece + KING] - material_keys[game->board[row][col] + KING];
+    game->board[row][col] = piece;
+}
+
+// getting the pawn structure terms of the position from ctx's pawn table, computing them on a miss
+// a pawn is passed with no enemy pawn in front of it on its own or a neighbouring file, isolated with no own pawn on
+// a neighbouring file, doubled behind another own pawn on its file and backward when no own pawn on a neighbouring file
+// is level with it or behind it and an enemy pawn guards the square in front of it
+struct pawn_entry *pawn_probe(struct search_context *ctx, struct chess_game *game) {
+    struct pawn_entry *entry = &ctx->pawns[game->pawn_key & (PAWN_HASH_ENTRIES - 1)];
+    int count[2][BOARD_SIZE] = {{0}};
+    int rearmost[2][BOARD_SIZE];
+    int foremost[2][BOARD_SIZE];
+    int mg[2] = {0, 0};
+    int eg[2] = {0, 0};
+    int side;
+    int sign;
+    int row;
+    int col;
+    int rank;
+    int file;
+    bool passed;
+    bool supported;
+
+    if (entry->key == game->pawn_key)
+        return entry;
+
+    // rows of each side's rearmost and foremost pawn on every file (-1 if none)
+    for (side = 0; side < 2; side++) {
+        for (col = 0; col < BOARD_SIZE; col++) {
+            rearmost[side][col] = -1;
+            foremost[side][col] = -1;
+        }
+    }
+    for (row = 0; row < BOARD_SIZE; row++) {
+        for (col = 0; col < BOARD_SIZE; col++) {
+            if (abs(game->board[row][col]) != PAWN)
+                continue;
+            side = SIDE_INDEX(game->board[row][col]);
+            sign = game->board[row][col];
+            count[side][col]++;
+            if (rearmost[side][col] < 0 || (row - rearmost[side][col]) * sign < 0)
+                rearmost[side][col] = row;
+            if (foremost[side][col] < 0 || (row - foremost[side][col]) * sign > 0)
+                foremost[side][col] = row;
+        }
+    }
+
+    for (row = 0; row < BOARD_SIZE; row++) {
+        for (col = 0; col < BOARD_SIZE; col++) {
+            if (abs(game->board[row][col]) != PAWN)
+                continue;
+            sign = game->board[row][col];
+            side = SIDE_INDEX(sign);
+            rank = sign > 0 ? row : BOARD_SIZE - 1 - row;
+
+            passed = true;
+            supported = false;
+            for (file = max(col - 1, 0); file <= min(col + 1, BOARD_SIZE - 1); file++) {
+                if (rearmost[!side][file] >= 0 && (rearmost[!side][file] - row) * sign > 0)
+                    passed = false;
+                if (file != col && rearmost[side][file] >= 0 && (rearmost[side][file] - row) * sign <= 0)
+                    supported = true;
+            }
+            if (passed && foremost[side][col] == row) {
+                mg[side] += passed_mg[rank];
+                eg[side] += passed_eg[rank];
+            }
+            if ((col == 0 || !count[side][col - 1]) && (col == BOARD_SIZE - 1 || !count[side][col + 1])) {
+                mg[side] -= ISOLATED_MG;
+                eg[side] -= ISOLATED_EG;
+            } else if (!supported && ON_BOARD(row + 2 * sign, col) &&
+                       ((col > 0 && game->board[row + 2 * sign][col - 1] == -sign * PAWN) ||
+                        (col < BOARD_SIZE - 1 && game->board[row + 2 * sign][col + 1] == -sign * PAWN))) {
+                mg[side] -= BACKWARD_MG;
+                eg[side] -= BACKWARD_EG;
+            }
+            if (row != foremost[side][col]) {
+                mg[side] -= DOUBLED_MG;
+                eg[side] -= DOUBLED_EG;
+            }
+        }
+    }
+
+    for (side = 0; side < 2; side++) {
+        for (col = 0; col < BOARD_SIZE; col++) {
+            row = rearmost[side][col];
+            entry->shield[side][col] = row < 0 ? 0 : side == SIDE_INDEX(1) ? row : BOARD_SIZE - 1 - row;
+        }
+    }
+    entry->mg_score = mg[SIDE_INDEX(1)] - mg[SIDE_INDEX(-1)];
+    entry->eg_score = eg[SIDE_INDEX(1)] - eg[SIDE_INDEX(-1)];
+    entry->key = game->pawn_key;
+    return entry;
+}
+
+// getting the material terms of the position from ctx's material table, computing them from the counts on a miss
+// a side without pawns that is at most a bishop ahead (counted in endgame values) is hard to win with: not at all with a
+// single minor piece and seldom with more, nor with two knights against a bare king
+// a bare king against no pawns and a queen, a rook, two bishops or bishop and knight gets an endgame evaluator,
+// and against a single pawn the bitbase one
+struct material_entry *material_probe(struct search_context *ctx, struct chess_game *game) {
+    struct material_entry *entry = &ctx->materials[(game->material * 0x9e3779b97f4a7c15ULL) >> (64 - ilog2(MATERIAL_HASH_ENTRIES))];
+    int count[2][KING];
+    int pieces[2] = {0, 0};
+    int imbalance[2];
+    int side;
+    int type;
+    int scale;
+
+    if (entry->key == game->material)
+        return entry;
+
+    for (side = 0; side < 2; side++) {
+        for (type = PAWN; type < KING; type++) {
+            count[side][type] = MATERIAL_COUNT(game->material, side, type);
+            if (type != PAWN)
+                pieces[side] += count[side][type] * material_eg[type];
+        }
+        imbalance[side] = (count[side][BISHOP] >= 2 ? BISHOP_PAIR : 0) + count[side][KNIGHT] * (count[side][PAWN] - 5) * KNIGHT_PAWNS -
+                          count[side][ROOK] * (count[side][PAWN] - 5) * ROOK_PAWNS;
+    }
+
+    entry->endgame = NULL;
+    entry->strong = 0;
+    for (side = 0; side < 2; side++) {
+        scale = SCALE_NORMAL;
+        if (!count[side][PAWN] && pieces[side] - pieces[!side] <= material_eg[BISHOP])
+            scale = pieces[side] < material_eg[ROOK] ? 0 : SCALE_NORMAL / 4;
+        else if (!count[side][PAWN] && pieces[side] == count[side][KNIGHT] * material_eg[KNIGHT] && count[side][KNIGHT] == 2 &&
+                 !pieces[!side] && !count[!side][PAWN])
+            scale = 0;
+        entry->scale[side] = scale;
+
+        if (count[!side][PAWN] || pieces[!side])
+            continue;
+        if (count[side][PAWN] == 1 && !pieces[side] && kpk_ready)
+            entry->endgame = endgame_kpk;
+        else if (count[side][PAWN])
+            continue;
+        else if (count[side][KNIGHT] == 1 && count[side][BISHOP] == 1 && pieces[side] == material_eg[KNIGHT] + material_eg[BISHOP])
+            entry->endgame = endgame_kbnk;
+        else if (count[side][QUEEN] || count[side][ROOK] || count[side][BISHOP] >= 2 || (count[side][BISHOP] && count[side][KNIGHT]))
+            entry->endgame = endgame_kxk;
+        if (entry->endgame)
+            entry->strong = side == SIDE_INDEX(1) ? 1 : -1;
+    }
+    entry->imbalance = imbalance[SIDE_INDEX(1)] - imbalance[SIDE_INDEX(-1)];
+    entry->key = game->material;
+    return entry;
+}
+
+// the distance in king moves between two squares given as [col, row] like the king positions
+static inline int king_distance(int *a, int *b) {
+    return max(abs(a[0] - b[0]), abs(a[1] - b[1]));
+}
+
+// a lone king is mated on the edge with the other king close by, so the score (for the strong side, 1 or -1) grows
+// as the weak king nears the edge and the kings near each other, on top of the material and a won position bonus
+int endgame_kxk(struct chess_game *game, int strong) {
+    int *strong_king = strong > 0 ? game->white_king : game->black_king;
+    int *weak_king = strong > 0 ? game->black_king : game->white_king;
+
+    return game->eg_score * strong + ENDGAME_WIN + 10 * (abs(2 * weak_king[0] - 7) + abs(2 * weak_king[1] - 7)) +
+           20 * (7 - king_distance(strong_king, weak_king));
+}
+
+// bishop and knight only mate in a corner of the bishop's colour, so the weak king is driven towards the nearer one,
+// its distance counted along files and ranks so every step towards the corner scores
+int endgame_kbnk(struct chess_game *game, int strong) {
+    int *strong_king = strong > 0 ? game->white_king : game->black_king;
+    int *weak_king = strong > 0 ? game->black_king : game->white_king;
+    int corners[2][2] = {{0, 0}, {BOARD_SIZE - 1, BOARD_SIZE - 1}};
+    int row;
+    int col;
+
+    // a1 and h8 are dark, if the bishop is on a light square the corners are a8 and h1
+    for (row = 0; row < BOARD_SIZE; row++) {
+        for (col = 0; col < BOARD_SIZE; col++) {
+            if (game->board[row][col] == strong * BISHOP && (row + col) % 2) {
+                corners[0][1] = BOARD_SIZE - 1;
+                corners[1][1] = 0;
+            }
+        }
+    }
+    return game->eg_score * strong + ENDGAME_WIN +
+           20 * (14 - min(abs(weak_king[0] - corners[0][0]) + abs(weak_king[1] - corners[0][1]),
+                           abs(weak_king[0] - corners[1][0]) + abs(weak_king[1] - corners[1][1]))) +
+           20 * (7 - king_distance(strong_king, weak_king));
+}
+
+// the bitbase knows if the pawn wins, a won position scores like the other endgames (the pawn's piece-square
+// value makes pushing it pay), anything else is a draw
+// the board is seen from the side with the pawn as white, and mirrored so the pawn is on files a to d
+int endgame_kpk(struct chess_game *game, int strong) {
+    int *strong_king = strong > 0 ? game->white_king : game->black_king;
+    int *weak_king = strong > 0 ? game->black_king : game->white_king;
+    int flip = strong > 0 ? 0 : SQUARE(BOARD_SIZE - 1, 0);
+    int mirror = 0;
+    int pawn = 0;
+    int square;
+
+    for (square = 0; square < BOARD_SIZE * BOARD_SIZE; square++) {
+        if (game->board[square / BOARD_SIZE][square % BOARD_SIZE] == strong * PAWN)
+            pawn = square ^ flip;
+    }
+    if (pawn % BOARD_SIZE >= BOARD_SIZE / 2)
+        mirror = BOARD_SIZE - 1;
+    if (!kpk_probe((SQUARE(strong_king[1], strong_king[0]) ^ flip) ^ mirror, (SQUARE(weak_king[1], weak_king[0]) ^ flip) ^ mirror,
+                   pawn ^ mirror, SIDE_INDEX(game->current_turn * strong)))
+        return 0;
+    return game->eg_score * strong + ENDGAME_WIN;
+}
+
+// white king and black king squares, side to move (0 white) and the white pawn's square (files a to d, ranks 2 to 7)
+static inline unsigned int kpk_index(int white_king, int black_king, int pawn, int side) {
+    return white_king | black_king << 6 | side << 12 | (pawn % BOARD_SIZE) << 13 | (BOARD_SIZE - 2 - pawn / BOARD_SIZE) << 15;
+}
+
+// checking if white wins, the position must be given as kpk_index takes it
+bool kpk_probe(int white_king, int black_king, int pawn, int side) {
+    unsigned int index = kpk_index(white_king, black_king, pawn, side);
+
+    return kpk_bitbase[index / 32] & (1U << (index % 32));
+}
+
+// the result a position's moves give it: white wins if one of its moves wins and black draws if one of its moves
+// draws (moving onto the pawn or next to the other king gives an invalid position, which counts for nothing)
+// the pawn goes up one square, or two from its first rank, the promotions are known before any move is looked at
+static int kpk_classify(u8 *results, unsigned int index) {
+    int white_king = index & 63;
+    int black_king = (index >> 6) & 63;
+    int side = (index >> 12) & 1;
+    int pawn = SQUARE(BOARD_SIZE - 2 - (index >> 15), (index >> 13) & 3);
+    u64 moves = king_attacks[side ? black_king : white_king];
+    int found = 0;
+    int square;
+
+    while (moves) {
+        square = __ffs64(moves);
+        moves &= moves - 1;
+        found |= side ? results[kpk_index(white_king, square, pawn, 0)] : results[kpk_index(square, black_king, pawn, 1)];
+    }
+    if (!side && pawn / BOARD_SIZE < BOARD_SIZE - 2)
+        found |= results[kpk_index(white_king, black_king, pawn + BOARD_SIZE, 1)];
+    if (!side && pawn / BOARD_SIZE == 1 && pawn + BOARD_SIZE != white_king && pawn + BOARD_SIZE != black_king)
+        found |= results[kpk_index(white_king, black_king, pawn + 2 * BOARD_SIZE, 1)];
+
+    if (side)
+        return found & KPK_DRAW ? KPK_DRAW : found & KPK_UNKNOWN ? KPK_UNKNOWN : KPK_WIN;
+    return found & KPK_WIN ? KPK_WIN : found & KPK_UNKNOWN ? KPK_UNKNOWN : KPK_DRAW;
+}
+
+// building the bitbase by retrograde iteration: the positions decided by themselves first (illegal ones, promotions
+// that cannot be stopped, stalemates and a pawn the black king takes), then every undecided position from the results
+// of its moves until a pass changes nothing, what is still undecided then is a draw
+// the build is timed so its share of the module load shows in the log
+void kpk_init(void) {
+    ktime_t start = ktime_get();
+    unsigned int index;
+    u8 *results;
+    u64 pawn_attacks;
+    int white_king;
+    int black_king;
+    int side;
+    int pawn;
+    int passes = 0;
+    bool changed;
+
+    results = vmalloc(KPK_INDEXES);
+    if (!results) {
+        printk(KERN_WARNING "Chess: no memory to build the KPK bitbase\n");
+        return;
+    }
+    for (index = 0; index < KPK_INDEXES; index++) {
+        white_king = index & 63;
+        black_king = (index >> 6) & 63;
+        side = (index >> 12) & 1;
+        pawn = SQUARE(BOARD_SIZE - 2 - (index >> 15), (index >> 13) & 3);
+        pawn_attacks = (((1ULL << pawn) << 9) & ~FILE_A_SET) | (((1ULL << pawn) << 7) & ~FILE_H_SET);
+
+        if (white_king == black_king || (king_attacks[white_king] & (1ULL << black_king)) || white_king == pawn ||
+            black_king == pawn || (!side && (pawn_attacks & (1ULL << black_king))))
+            results[index] = KPK_INVALID;
+        else if (!side && pawn / BOARD_SIZE == BOARD_SIZE - 2 && white_king != pawn + BOARD_SIZE && black_king != pawn + BOARD_SIZE &&
+                 (!(king_attacks[black_king] & (1ULL << (pawn + BOARD_SIZE))) ||
+                  (king_attacks[white_king] & (1ULL << (pawn + BOARD_SIZE)))))
+            results[index] = KPK_WIN;
+        else if (side && (!(king_attacks[black_king] & ~(king_attacks[white_king] | pawn_attacks)) ||
+                          (king_attacks[black_king] & ~king_attacks[white_king] & (1ULL << pawn))))
+            results[index] = KPK_DRAW;
+        else
+            results[index] = KPK_UNKNOWN;
+    }
+
+    do {
+        changed = false;
+        for (index = 0; index < KPK_INDEXES; index++) {
+            if (results[index] != KPK_UNKNOWN)
+                continue;
+            results[index] = kpk_classify(results, index);
+            changed |= results[index] != KPK_UNKNOWN;
+        }
+        passes++;
+        cond_resched();
+    } while (changed);
+
+    for (index = 0; index < KPK_INDEXES; index++) {
+        if (results[index] == KPK_WIN)
+            kpk_bitbase[index / 32] |= 1U << (index % 32);
+    }
+    vfree(results);
+    kpk_ready = true;
+    printk(KERN_INFO "Chess: KPK bitbase built in %lld us (%d passes)\n", ktime_us_delta(ktime_get(), start), passes);
+}
+
+// a slider's attacks along directions first to last of king_offsets (0-3 rook, 4-7 bishop), each ray cut after its
+// first blocker: the nearest one is the lowest set square on rays going up the board (the even directions, a positive
+// square step) and the highest on rays going down (the odd ones), and the ray from the blocker on is taken off
+u64 slider_attacks(int square, u64 occupied, int first, int last) {
+    u64 attacks = 0;
+    u64 blockers;
+    int blocker;
+    int i;
+
+    for (i = first; i <= last; i++) {
+        attacks |= ray_attacks[i][square];
+        blockers = ray_attacks[i][square] & occupied;
+        if (!blockers)
+            continue;
+        blocker = i & 1 ? fls64(blockers) - 1 : __ffs64(blockers);
+        attacks &= ~ray_attacks[i][blocker];
+    }
+    return attacks;
+}
+
+// mobility of every knight, bishop, rook and queen (white positive) and its attacks on the enemy king zone,
+// a population count of its attack set each, info keeps the sets and the king zone attacks for king_safety
+void eval_pieces(struct chess_game *game, struct eval_info *info, int *mg, int *eg) {
+    const int *board = &game->board[0][0];
+    u64 pawns[2] = {0, 0};
+    u64 attacks;
+    int pieces[BOARD_SIZE * BOARD_SIZE];
+    int piece_count = 0;
+    int side;
+    int sign;
+    int piece;
+    int square;
+    int count;
+    int i;
+
+    // one pass over the board for the occupancy, the pawns and where the pieces with mobility stand
+    memset(info, 0, sizeof(*info));
+    for (square = 0; square < BOARD_SIZE * BOARD_SIZE; square++) {
+        piece = board[square];
+        if (piece == EMPTY)
+            continue;
+        info->occupied |= 1ULL << square;
+        info->pieces[SIDE_INDEX(piece)] |= 1ULL << square;
+        if (abs(piece) == PAWN)
+            pawns[SIDE_INDEX(piece)] |= 1ULL << square;
+        else if (abs(piece) != KING)
+            pieces[piece_count++] = square;
+    }
+    info->pawn_attacks[SIDE_INDEX(1)] = ((pawns[SIDE_INDEX(1)] << 9) & ~FILE_A_SET) | ((pawns[SIDE_INDEX(1)] << 7) & ~FILE_H_SET);
+    info->pawn_attacks[SIDE_INDEX(-1)] = ((pawns[SIDE_INDEX(-1)] >> 7) & ~FILE_A_SET) | ((pawns[SIDE_INDEX(-1)] >> 9) & ~FILE_H_SET);
+    square = SQUARE(game->white_king[1], game->white_king[0]);
+    info->king_zone[SIDE_INDEX(1)] = king_attacks[square] | 1ULL << square;
+    square = SQUARE(game->black_king[1], game->black_king[0]);
+    info->king_zone[SIDE_INDEX(-1)] = king_attacks[square] | 1ULL << square;
+
+    for (i = 0; i < piece_count; i++) {
+        square = pieces[i];
+        piece = board[square];
+        sign = piece > 0 ? 1 : -1;
+        side = SIDE_INDEX(piece);
+        piece = abs(piece);
+        if (piece == KNIGHT)
+            attacks = knight_attacks[square];
+        else if (piece == BISHOP)
+            attacks = slider_attacks(square, info->occupied, 4, 7);
+        else if (piece == ROOK)
+            attacks = slider_attacks(square, info->occupied, 0, 3);
+        else
+            attacks = slider_attacks(square, info->occupied, 0, 7);
+        count = hweight64(attacks & ~info->pieces[side] & ~info->pawn_attacks[!side]) - mobility_base[piece];
+        *mg += sign * count * mobility_mg[piece];
+        *eg += sign * count * mobility_eg[piece];
+        count = hweight64(attacks & info->king_zone[!side]);
+        if (count) {
+            info->zone_attacks[side] += count;
+            info->zone_attackers[side]++;
+            info->zone_weight[side] += count * zone_attack_weight[piece];
+        }
+    }
+}
+
+// the shield of side's king (a middlegame term): only while it stays on its first two ranks,
+// for its file and the two next to it a bonus for a pawn right in front or one further, a penalty for none
+int king_shield(struct pawn_entry *entry, int side, int king_row, int king_col) {
+    int rank = side == SIDE_INDEX(1) ? king_row : BOARD_SIZE - 1 - king_row;
+    int score = 0;
+    int file;
+
+    if (rank > 1)
+        return 0;
+    for (file = max(king_col - 1, 0); file <= min(king_col + 1, BOARD_SIZE - 1); file++) {
+        if (!entry->shield[side][file])
+            score -= SHIELD_OPEN;
+        else if (entry->shield[side][file] == rank + 1)
+            score += SHIELD_NEAR;
+        else if (entry->shield[side][file] == rank + 2)
+            score += SHIELD_FAR;
+    }
+    return score;
+}
+
+// the safety of side's king (a middlegame term) from what the evaluation already has: the shield and the open files
+// next to it from the pawn table, and the enemy attacks on its zone eval_pieces counted, no square is looked at again
+int king_safety(struct pawn_entry *pawns, struct eval_info *info, int side, int king_row, int king_col) {
+    int score = king_shield(pawns, side, king_row, king_col);
+    int weight = info->zone_weight[!side];
+    int file;
+
+    for (file = max(king_col - 1, 0); file <= min(king_col + 1, BOARD_SIZE - 1); file++) {
+        if (!pawns->shield[side][file] && !pawns->shield[!side][file])
+            score -= KING_OPEN_FILE;
+    }
+    if (info->zone_attackers[!side] >= 2)
+        score -= min(weight * weight / 4, KING_DANGER_MAX);
+    return score;
+}
+
+// reading a little-endian array of count elements of size bytes from the firmware data at *offset
+static void nnue_read(const struct firmware *fw, size_t *offset, void *dst, size_t count, size_t size) {
+    size_t i;
+
+    memcpy(dst, fw->data + *offset, count * size);
+    *offset += count * size;
+    for (i = 0; i < count; i++) {
+        if (size == sizeof(u16))
+            le16_to_cpus((u16 *)dst + i);
+        else if (size == sizeof(u32))
+            le32_to_cpus((u32 *)dst + i);
+    }
+}
+
+// loading the network through the firmware loader, the file must have this module's layer sizes
+// without one (or if it does not load) the search keeps the hand written evaluation
+int nnue_load(void) {
+    const struct firmware *fw;
+    struct nnue_net *net;
+    size_t offset = 0;
+    u32 header[6];
+    int ret;
+
+    ret = request_firmware(&fw, nnue_file, chessDevice);
+    if (ret) {
+        printk(KERN_WARNING "Chess: could not load the network %s (%d)\n", nnue_file, ret);
+        return ret;
+    }
+    ret = -EINVAL;
+    if (fw->size != sizeof(header) + NNUE_L1 * sizeof(s16) + (size_t)NNUE_INPUTS * NNUE_L1 * sizeof(s16) +
+                        NNUE_L2 * sizeof(s32) + NNUE_L2 * 2 * NNUE_L1 + NNUE_L3 * sizeof(s32) + NNUE_L3 * NNUE_L2 +
+                        sizeof(s32) + NNUE_L3) {
+        printk(KERN_WARNING "Chess: network %s has %zu bytes, not the size of a %dx2-%d-%d-1 network\n", nnue_file, fw->size,
+               NNUE_L1, NNUE_L2, NNUE_L3);
+        goto release;
+    }
+    nnue_read(fw, &offset, header, ARRAY_SIZE(header), sizeof(u32));
+    if (header[0] != NNUE_MAGIC || header[1] != NNUE_VERSION || header[2] != NNUE_INPUTS || header[3] != NNUE_L1 ||
+        header[4] != NNUE_L2 || header[5] != NNUE_L3) {
+        printk(KERN_WARNING "Chess: network %s has a bad header\n", nnue_file);
+        goto release;
+    }
+
+    ret = -ENOMEM;
+    net = vzalloc(sizeof(*net));
+    if (!net)
+        goto release;
+    net->feature_weights = vmalloc(array_size((size_t)NNUE_INPUTS * NNUE_L1, sizeof(s16)));
+    if (!net->feature_weights) {
+        vfree(net);
+        goto release;
+    }
+    nnue_read(fw, &offset, net->feature_biases, NNUE_L1, sizeof(s16));
+    nnue_read(fw, &offset, net->feature_weights, (size_t)NNUE_INPUTS * NNUE_L1, sizeof(s16));
+    nnue_read(fw, &offset, net->l1_biases, NNUE_L2, sizeof(s32));
+    nnue_read(fw, &offset, net->l1_weights, NNUE_L2 * 2 * NNUE_L1, sizeof(s8));
+    nnue_read(fw, &offset, net->l2_biases, NNUE_L3, sizeof(s32));
+    nnue_read(fw, &offset, net->l2_weights, NNUE_L3 * NNUE_L2, sizeof(s8));
+    nnue_read(fw, &offset, &net->out_bias, 1, sizeof(s32));
+    nnue_read(fw, &offset, net->out_weights, NNUE_L3, sizeof(s8));
+    nnue = net;
+    ret = 0;
+
+#ifdef CONFIG_X86_64
+    nnue_simd = boot_cpu_has(X86_FEATURE_AVX2);
+#endif
+    printk(KERN_INFO "Chess: loaded the network %s, running %s\n", nnue_file, nnue_simd ? "with avx2" : "in plain C");
+release:
+    release_firmware(fw);
+    return ret;
+}
+
+// releasing the network when the module goes away
+void nnue_free(void) {
+    if (!nnue)
+        return;
+    vfree(nnue->feature_weights);
+    vfree(nnue);
+    nnue = NULL;
+}
+
+// the first layer input of a non-king piece on square from side's point of view
+// black sees the board flipped so both sides see their own king from their first rank
+static inline int nnue_feature(int side, int king_square, int piece, int square) {
+    if (side == SIDE_INDEX(-1)) {
+        king_square ^= SQUARE(BOARD_SIZE - 1, 0);
+        square ^= SQUARE(BOARD_SIZE - 1, 0);
+    }
+    return ((king_square * 10 + (abs(piece) - 1) * 2 + (SIDE_INDEX(piece) != side)) * BOARD_SIZE * BOARD_SIZE + square);
+}
+
+// with avx2 these are only called between nnue_fpu_begin and nnue_fpu_end
+static inline void nnue_add(s16 *values, int feature) {
+    const s16 *weights = nnue->feature_weights + (size_t)feature * NNUE_L1;
+    int i;
+
+#ifdef CONFIG_X86_64
+    if (nnue_simd) {
+        nnue_add_avx2(values, weights, NNUE_L1);
+        return;
+    }
+#endif
+    for (i = 0; i < NNUE_L1; i++)
+        values[i] += weights[i];
+}
+
+static inline void nnue_sub(s16 *values, int feature) {
+    const s16 *weights = nnue->feature_weights + (size_t)feature * NNUE_L1;
+    int i;
+
+#ifdef CONFIG_X86_64
+    if (nnue_simd) {
+        nnue_sub_avx2(values, weights, NNUE_L1);
+        return;
+    }
+#endif
+    for (i = 0; i < NNUE_L1; i++)
+        values[i] -= weights[i];
+}
+
+// one FPU section around a whole first layer update rather than one per feature, a no-op without avx2
+static inline void nnue_fpu_begin(void) {
+#ifdef CONFIG_X86_64
+    if (nnue_simd)
+        kernel_fpu_begin();
+#endif
+}
+
+static inline void nnue_fpu_end(void) {
+#ifdef CONFIG_X86_64
+    if (nnue_simd)
+        kernel_fpu_end();
+#endif
+}
+
+// the biases plus the weights of every non-king piece on the board, for side's point of view
+// the caller holds the FPU section nnue_add needs
+void nnue_refresh(struct chess_game *game, struct nnue_accumulator *accumulator, int side) {
+    s16 *values = accumulator->values[side];
+    int king_square = side == SIDE_INDEX(1) ? SQUARE(game->white_king[1], game->white_king[0])
+                                            : SQUARE(game->black_king[1], game->black_king[0]);
+    int piece;
+    int square;
+
+    memcpy(values, nnue->feature_biases, sizeof(nnue->feature_biases));
+    for (square = 0; square < BOARD_SIZE * BOARD_SIZE; square++) {
+        piece = game->board[square / BOARD_SIZE][square % BOARD_SIZE];
+        if (piece != EMPTY && abs(piece) != KING)
+            nnue_add(values, nnue_feature(side, king_square, piece, square));
+    }
+}
+
+// the next stack entry is the current one with the moved piece taken off its start square, the captured one off
+// the end square and the piece that stands there now put on, a side whose king moved gets all its inputs
+// changed so that side is refreshed instead, called by make_move once the board and kings are updated
+void nnue_make(struct chess_game *game, struct cpu_move *move, struct search_undo *undo) {
+    struct nnue_accumulator *previous = game->accumulator;
+    struct nnue_accumulator *next = previous + 1;
+    int from = SQUARE(move->start_row, move->start_col);
+    int to = SQUARE(move->end_row, move->end_col);
+    int placed = game->board[move->end_row][move->end_col];
+    int king_square;
+    int side;
+
+    nnue_fpu_begin();
+    for (side = 0; side < 2; side++) {
+        if (undo->moved == (side == SIDE_INDEX(1) ? KING : -KING)) {
+            nnue_refresh(game, next, side);
+            continue;
+        }
+        king_square = side == SIDE_INDEX(1) ? SQUARE(game->white_king[1], game->white_king[0])
+                                            : SQUARE(game->black_king[1], game->black_king[0]);
+        memcpy(next->values[side], previous->values[side], sizeof(next->values[side]));
+        if (abs(undo->moved) != KING) {
+            nnue_sub(next->values[side], nnue_feature(side, king_square, undo->moved, from));
+            nnue_add(next->values[side], nnue_feature(side, king_square, placed, to));
+        }
+        if (undo->captured != EMPTY)
+            nnue_sub(next->values[side], nnue_feature(side, king_square, undo->captured, to));
+    }
+    nnue_fpu_end();
+    game->accumulator = next;
+}
+
+// putting ctx's board (the position ply plies below the root) on entry ply of ctx's network stack, computed from scratch,
+// or off any stack if no network is loaded or eval_nnue is off
+void nnue_attach(struct search_context *ctx, int ply) {
+    struct chess_game *game = &ctx->board;
+
+    game->accumulator = NULL;
+    if (!nnue || !eval_nnue || !ctx->accumulators)
+        return;
+    nnue_fpu_begin();
+    nnue_refresh(game, &ctx->accumulators[ply], SIDE_INDEX(1));
+    nnue_refresh(game, &ctx->accumulators[ply], SIDE_INDEX(-1));
+    nnue_fpu_end();
+    game->accumulator = &ctx->accumulators[ply];
+}
+
+// one hidden layer in plain C: out[i] = clip((biases[i] + weights[i] . input) >> NNUE_SHIFT)
+static void nnue_layer(const u8 *input, int inputs, const s8 *weights, const s32 *biases, u8 *output, int outputs) {
+    s32 sum;
+    int i;
+    int j;
+
+    for (i = 0; i < outputs; i++) {
+        sum = biases[i];
+        for (j = 0; j < inputs; j++)
+            sum += input[j] * weights[i * inputs + j];
+        output[i] = clamp(sum >> NNUE_SHIFT, 0, 127);
+    }
+}
+
+// the network's score from the side to move's point of view: its first layer sums then the other side's, clipped,
+// through both hidden layers to the output (kept out of the mate range)
+int nnue_evaluate(struct chess_game *game) {
+    struct nnue_accumulator *accumulator = game->accumulator;
+    u8 input[2 * NNUE_L1] __aligned(32);
+    u8 hidden1[NNUE_L2] __aligned(32);
+    u8 hidden2[NNUE_L3] __aligned(32);
+    int us = SIDE_INDEX(game->current_turn);
+    s32 score;
+    int i;
+
+    for (i = 0; i < NNUE_L1; i++) {
+        input[i] = clamp_t(s16, accumulator->values[us][i], 0, 127);
+        input[NNUE_L1 + i] = clamp_t(s16, accumulator->values[!us][i], 0, 127);
+    }
+#ifdef CONFIG_X86_64
+    if (nnue_simd) {
+        kernel_fpu_begin();
+        nnue_layer_avx2(input, 2 * NNUE_L1, &nnue->l1_weights[0][0], nnue->l1_biases, hidden1, NNUE_L2, NNUE_SHIFT);
+        nnue_layer_avx2(hidden1, NNUE_L2, &nnue->l2_weights[0][0], nnue->l2_biases, hidden2, NNUE_L3, NNUE_SHIFT);
+        kernel_fpu_end();
+    } else
+#endif
+    {
+        nnue_layer(input, 2 * NNUE_L1, &nnue->l1_weights[0][0], nnue->l1_biases, hidden1, NNUE_L2);
+        nnue_layer(hidden1, NNUE_L2, &nnue->l2_weights[0][0], nnue->l2_biases, hidden2, NNUE_L3);
+    }
+    score = nnue->out_bias;
+    for (i = 0; i < NNUE_L3; i++)
+        score += hidden2[i] * nnue->out_weights[i];
+    return clamp(score / NNUE_SCALE, -MATE_SCORE + MAX_PLY + 1, MATE_SCORE - MAX_PLY - 1);
+}
+
+// material and piece-square evaluation from the side to move's point of view, read from the running sums,
+// plus the pawn structure from ctx's pawn table, the pieces' mobility and both kings' safety
+// tapered: the middlegame sum with every piece on the board, the endgame one with only kings and pawns, in between
+// the two are blended by the phase, then the material table adds the imbalance and scales down hard to win endings
+// a board on a network stack is evaluated by the network instead, and an endgame with its own evaluator by that
+// either way the score is looked up in the evaluation cache first and stored there after
+// lazy evaluation: when the material and piece-square score alone is eval_lazy_margin beyond alpha or beta the
+// other terms cannot bring it back into the window, that score is returned as is (and not cached)
+int search_evaluate(struct search_context *ctx, struct chess_game *game, int alpha, int beta) {
+    struct material_entry *material;
+    struct pawn_entry *pawns;
+    struct eval_info info;
+    int phase = min(game->phase, PHASE_MAX);
+    u64 key = (game->key ^ (game->accumulator ? zobrist_network : 0)) & ~(u64)U16_MAX;
+    u64 *slot = NULL;
+    u64 cached;
+    int score;
+    int mg;
+    int eg;
+
+    if (eval_cache) {
+        slot = &eval_cache[(key >> 16) & eval_cache_mask];
+        cached = READ_ONCE(*slot);
+        ctx->eval_probes++;
+        if ((cached & ~(u64)U16_MAX) == key) {
+            ctx->eval_hits++;
+            return (s16)cached;
+        }
+    }
+
+    material = material_probe(ctx, game);
+    if (material->endgame) {
+        score = material->endgame(game, material->strong) * material->strong * game->current_turn;
+    } else if (game->accumulator) {
+        score = nnue_evaluate(game);
+    } else {
+        mg = game->mg_score + material->imbalance;
+        eg = game->eg_score + material->imbalance;
+        score = eg + (mg - eg) * phase / PHASE_MAX;
+        score = score * material->scale[SIDE_INDEX(score)] / SCALE_NORMAL * game->current_turn;
+        if (eval_lazy_margin > 0 && (score - eval_lazy_margin >= beta || score + eval_lazy_margin <= alpha))
+            return score;
+
+        pawns = pawn_probe(ctx, game);
+        mg += pawns->mg_score;
+        eg += pawns->eg_score;
+
+        eval_pieces(game, &info, &mg, &eg);
+
+        mg += king_safety(pawns, &info, SIDE_INDEX(1), game->white_king[1], game->white_king[0]) -
+              king_safety(pawns, &info, SIDE_INDEX(-1), game->black_king[1], game->black_king[0]);
+        score = eg + (mg - eg) * phase / PHASE_MAX;
+        score = score * material->scale[SIDE_INDEX(score)] / SCALE_NORMAL * game->current_turn;
+    }
+
+    if (slot)
+        WRITE_ONCE(*slot, key | (u16)score);
+    return score;
+}
+
+// the transposition table lookup of a search_alphabeta node: the stored move is searched first, and outside the pv
+// (null window) a bound from a deep enough search ends the node right away with *score
+bool search_probe(struct search_context *ctx, int ply, int *score) {
+    struct search_frame *frame = &ctx->frames[ply];
+    struct tt_entry entry;
+
+    if (!tt_probe(ctx->board.key, &entry))
+        return false;
+    tt_entry_move(&entry, &frame->hash_move);
+    *score = entry.score;
+    if (*score >= MATE_SCORE - MAX_PLY)
+        *score -= ply;
+    else if (*score <= -MATE_SCORE + MAX_PLY)
+        *score += ply;
+    return frame->beta - frame->alpha == 1 && entry.depth >= frame->depth &&
+           (entry.bound == TT_EXACT || (entry.bound == TT_LOWER && *score >= frame->beta) || (entry.bound == TT_UPPER && *score <= frame->alpha));
+}
+
+// playing the move at frame->index of a search_alphabeta node, taken back again and false if it leaves the king in check
+// a legal one is counted and gets its late move reduction: quiet moves past the killers and countermove that do not
+// give check are searched shallower and only get the full depth back if they beat alpha
+bool search_try_move(struct search_context *ctx, int ply) {
+    struct chess_game *game = &ctx->board;
+    struct search_frame *frame = &ctx->frames[ply];
+
+    pick_move(frame->moves, frame->count, frame->index);
+    frame->move = frame->moves[frame->index];
+    make_move(game, &frame->move, &frame->undo);
+    if (in_check(game, -game->current_turn)) {
+        unmake_move(game, &frame->move, &frame->undo);
+        return false;
+    }
+    frame->legal++;
+    frame->quiet = frame->undo.captured == EMPTY && abs(frame->move.promotion) != QUEEN;
+
+    frame->reduction = 0;
+    if (frame->quiet && !frame->check && frame->depth >= lmr_min_depth && frame->legal > lmr_min_moves &&
+        frame->move.score < COUNTERMOVE_SCORE && !in_check(game, game->current_turn))
+        frame->reduction = min(lmr_table[min(frame->depth, MAX_PLY - 1)][min(frame->legal, LMR_MOVES - 1)], frame->depth - 1);
+    return true;
+}
+
+// giving the node at ply its depth and window before search_alphabeta enters it
+void search_enter(struct search_context *ctx, int ply, int depth, int alpha, int beta) {
+    struct search_frame *frame = &ctx->frames[ply];
+
+    frame->depth = depth;
+    frame->alpha = alpha;
+    frame->beta = beta;
+    frame->stage = SEARCH_ENTER;
+}
+
+// principal variation search, moves are tried in score_moves order so the best capture usually comes first
+// only the first move gets the full window, the rest are proven worse with a zero window and re-searched if not
+// a null move is tried first when the side to move looks well ahead, and late quiet moves are searched shallower
+// at depth 0 only captures are searched, those that lose material by SEE are sorted last and skipped
+// the recursion runs over ctx->frames and not the kernel stack: a node descends by filling in its child's frame and
+// moving to ply + 1, and the child's score goes back to the node at the stage it was left at, so how deep the search
+// goes is only limited by max_ply (search_split calls back in here, but at most MAX_SPLITS times)
+int search_alphabeta(struct search_context *ctx, int depth, int alpha, int beta, int ply) {
+    struct chess_game *game = &ctx->board;
+    struct search_frame *frame;
+    int top = ply;
+    int score = 0;
+
+    search_enter(ctx, ply, depth, alpha, beta);
+    for (;;) {
+        frame = &ctx->frames[ply];
+
+        // a case that breaks out of the switch is done with its node and returns score to the parent,
+        // one that continues went on to another stage or descended
+        switch (frame->stage) {
+        case SEARCH_ENTER:
+            frame->pv_length = 0;
+            memset(&frame->hash_move, 0, sizeof(frame->hash_move));
+            score = 0;
+            if (search_should_stop(ctx))
+                break;
+
+            // quiescence: the evaluation stands in for not capturing
+            if (frame->depth <= 0) {
+                score = search_evaluate(ctx, game, frame->alpha, frame->beta);
+                if (score >= frame->beta || ply >= ctx->max_ply - 1)
+                    break;
+                frame->alpha = max(frame->alpha, score);
+                frame->count = generate_moves(game, frame->moves, true);
+                score_moves(ctx, game, frame->moves, frame->count, ply);
+                frame->index = 0;
+                frame->stage = SEARCH_NEXT_CAPTURE;
+                continue;
+            }
+
+            if (ply >= ctx->max_ply - 1) {
+                score = search_evaluate(ctx, game, frame->alpha, frame->beta);
+                break;
+            }
+            frame->alpha_start = frame->alpha;
+            if (search_probe(ctx, ply, &score))
+                break;
+            frame->check = in_check(game, game->current_turn);
+
+            // null move pruning: if passing still fails high, a real move will too
+            // never twice in a row, never in check and never with only king and pawns left
+            if (ply > 0 && !frame->check && frame->depth >= 2 && frame->beta < MATE_SCORE - MAX_PLY &&
+                !IS_NULL_MOVE(&ctx->frames[ply - 1].move) && has_non_pawn_material(game, game->current_turn) &&
+                search_evaluate(ctx, game, frame->beta - 1, frame->beta) >= frame->beta) {
+                memset(&frame->move, 0, sizeof(frame->move));
+                game->current_turn = -game->current_turn;
+                game->key ^= zobrist_side;
+                frame->stage = SEARCH_NULL_MOVE;
+                search_enter(ctx, ++ply, frame->depth - 1 - null_move_reduction - frame->depth / 6, -frame->beta, -frame->beta + 1);
+                continue;
+            }
+            frame->stage = SEARCH_MOVES;
+            continue;
+
+        case SEARCH_NULL_MOVE:
+            game->current_turn = -game->current_turn;
+            game->key ^= zobrist_side;
+            if (search_aborted(ctx)) {
+                score = 0;
+                break;
+            }
+            if (score >= frame->beta) {
+                score = score >= MATE_SCORE - MAX_PLY ? frame->beta : score;
+                break;
+            }
+            frame->stage = SEARCH_MOVES;
+            continue;
+
+        case SEARCH_MOVES:
+            frame->count = generate_moves(game, frame->moves, false);
+            score_moves(ctx, game, frame->moves, frame->count, ply);
+            frame->legal = 0;
+            frame->index = 0;
+            frame->stage = SEARCH_NEXT_MOVE;
+            continue;
+
+        case SEARCH_NEXT_MOVE:
+            if (frame->index >= frame->count) {
+                frame->stage = SEARCH_END;
+                continue;
+            }
+
+            // young brothers wait: once the eldest move is searched the others may be shared with idle helpers
+            if (frame->legal > 0 && search_can_split(ctx, frame->depth)) {
+                score = search_split(ctx, frame->depth, frame->alpha, frame->beta, ply, frame->index);
+                if (search_aborted(ctx)) {
+                    score = 0;
+                    break;
+                }
+                frame->alpha = score;
+                frame->stage = SEARCH_END;
+                continue;
+            }
+
+            if (!search_try_move(ctx, ply)) {
+                frame->index++;
+                continue;
+            }
+            if (frame->legal == 1) {
+                frame->stage = SEARCH_FULL_WINDOW;
+                search_enter(ctx, ++ply, frame->depth - 1, -frame->beta, -frame->alpha);
+            } else {
+                frame->stage = SEARCH_REDUCED;
+                search_enter(ctx, ++ply, frame->depth - 1 - frame->reduction, -frame->alpha - 1, -frame->alpha);
+            }
+            continue;
+
+        case SEARCH_REDUCED:
+            if (score > frame->alpha && frame->reduction > 0) {
+                frame->stage = SEARCH_ZERO_WINDOW;
+                search_enter(ctx, ++ply, frame->depth - 1, -frame->alpha - 1, -frame->alpha);
+                continue;
+            }
+            frame->stage = SEARCH_ZERO_WINDOW;
+            continue;
+
+        case SEARCH_ZERO_WINDOW:
+            if (score > frame->alpha && score < frame->beta) {
+                frame->stage = SEARCH_FULL_WINDOW;
+                search_enter(ctx, ++ply, frame->depth - 1, -frame->beta, -frame->alpha);
+                continue;
+            }
+            frame->stage = SEARCH_FULL_WINDOW;
+            continue;
+
+        case SEARCH_FULL_WINDOW:
+            unmake_move(game, &frame->move, &frame->undo);
+            if (search_aborted(ctx)) {
+                score = 0;
+                break;
+            }
+            if (score > frame->alpha) {
+                frame->alpha = score;
+                update_pv(ctx, ply, &frame->move);
+                if (frame->alpha >= frame->beta) {
+                    if (frame->quiet)
+                        update_quiet_stats(ctx, game, &frame->move, frame->depth, ply);
+                    frame->stage = SEARCH_END;
+                    continue;
+                }
+            }
+            frame->index++;
+            frame->stage = SEARCH_NEXT_MOVE;
+            continue;
+
+        case SEARCH_END:
+            // no legal move is checkmate if in check, otherwise stalemate
+            if (frame->legal == 0) {
+                score = frame->check ? -MATE_SCORE + ply : 0;
+                break;
+            }
+            tt_store(game->key, frame->depth, frame->alpha,
+                     frame->alpha >= frame->beta ? TT_LOWER : frame->alpha > frame->alpha_start ? TT_EXACT : TT_UPPER,
+                     frame->pv_length ? &frame->pv[0] : NULL, ply);
+            score = frame->alpha;
+            break;
+
+        case SEARCH_NEXT_CAPTURE:
+            if (frame->index >= frame->count) {
+                score = frame->alpha;
+                break;
+            }
+            pick_move(frame->moves, frame->count, frame->index);
+            if (frame->moves[frame->index].score < 0) {
+                score = frame->alpha;
+                break;
+            }
+            frame->move = frame->moves[frame->index];
+            make_move(game, &frame->move, &frame->undo);
+            if (in_check(game, -game->current_turn)) {
+                unmake_move(game, &frame->move, &frame->undo);
+                frame->index++;
+                continue;
+            }
+            frame->stage = SEARCH_CAPTURE;
+            search_enter(ctx, ++ply, 0, -frame->beta, -frame->alpha);
+            continue;
+
+        case SEARCH_CAPTURE:
+            unmake_move(game, &frame->move, &frame->undo);
+            if (search_aborted(ctx)) {
+                score = 0;
+                break;
+            }
+            if (score > frame->alpha) {
+                frame->alpha = score;
+                if (frame->alpha >= frame->beta) {
+                    score = frame->alpha;
+                    break;
+                }
+            }
+            frame->index++;
+            frame->stage = SEARCH_NEXT_CAPTURE;
+            continue;
+        }
+
+        if (ply == top)
+            return score;
+        ply--;
+        score = -score;
+    }
+}
+
+// generating the legal root moves into the root frame, shuffled first so equally good moves are not always
+// picked in board-scan order and then sorted by the ordering scores (the transposition table move first),
+// seed is mixed with the position's zobrist key for the shuffle
+int search_root_moves(struct search_context *ctx, u64 seed) {
+    struct chess_game *game = &ctx->board;
+    struct search_frame *frame = &ctx->frames[0];
+    struct cpu_move temp;
+    struct search_undo undo;
+    struct tt_entry entry;
+    u64 random_state;
+    int count;
+    int legal = 0;
+    int i;
+    int j;
+
+    memset(&frame->hash_move, 0, sizeof(frame->hash_move));
+    if (tt_probe(game->key, &entry))
+        tt_entry_move(&entry, &frame->hash_move);
+
+    // keeping only the legal root moves
+    count = generate_moves(game, frame->moves, false);
+    for (i = 0; i < count; i++) {
+        make_move(game, &frame->moves[i], &undo);
+        j = in_check(game, -game->current_turn);
+        unmake_move(game, &frame->moves[i], &undo);
+        if (!j)
+            frame->moves[legal++] = frame->moves[i];
+    }
+    frame->count = legal;
+
+    random_state = game->key ^ seed;
+    if (!random_state)
+        random_state = 1;
+    for (i = legal - 1; i > 0; i--) {
+        j = search_random(&random_state) % (i + 1);
+        temp = frame->moves[i];
+        frame->moves[i] = frame->moves[j];
+        frame->moves[j] = temp;
+    }
+    score_moves(ctx, game, frame->moves, legal, 0);
+    for (i = 0; i < legal; i++)
+        pick_move(frame->moves, legal, i);
+    return legal;
+}
+
+// searching the root moves from first on once inside (alpha, beta) the same way search_alphabeta searches its moves
+// the moves before first are left out, which is how a multi-pv analysis finds its next best line
+// the best move is moved to first (also when it failed high) and the score is returned, alpha if all failed low
+// if the search is stopped the moves that finished still count, so the front move is the best found so far
+// the root pv is only what this call found, empty if no move beat alpha or none finished
+int search_root(struct search_context *ctx, int depth, int alpha, int beta, int first) {
+    struct chess_game *game = &ctx->board;
+    struct search_frame *frame = &ctx->frames[0];
+    struct cpu_move temp;
+    int best_index = first;
+    int alpha_start = alpha;
+    int score;
+    int i;
+
+    frame->pv_length = 0;
+    for (i = first; i < frame->count; i++) {
+        // root splitting: the first move sets alpha here, the others are all searched against it at once
+        if (i > first && root_active) {
+            score = search_root_split(ctx, depth, alpha, beta, i, &best_index);
+            alpha = max(alpha, score);
+            break;
+        }
+
+        frame->move = frame->moves[i];
+        make_move(game, &frame->move, &frame->undo);
+        if (i == first) {
+            score = -search_alphabeta(ctx, depth - 1, -beta, -alpha, 1);
+        } else {
+            score = -search_alphabeta(ctx, depth - 1, -alpha - 1, -alpha, 1);
+            if (score > alpha && score < beta)
+                score = -search_alphabeta(ctx, depth - 1, -beta, -alpha, 1);
+        }
+        unmake_move(game, &frame->move, &frame->undo);
+        if (ctx->stop)
+            break;
+
+        if (score > alpha) {
+            alpha = score;
+            best_index = i;
+            update_pv(ctx, 0, &frame->move);
+            if (alpha >= beta)
+                break;
+        }
+    }
+
+    temp = frame->moves[best_index];
+    memmove(&frame->moves[first + 1], &frame->moves[first], (best_index - first) * sizeof(*frame->moves));
+    frame->moves[first] = temp;
+
+    // only a search of every root move says something about the position itself
+    if (first == 0 && !ctx->stop)
+        tt_store(game->key, depth, alpha, alpha >= beta ? TT_LOWER : alpha > alpha_start ? TT_EXACT : TT_UPPER,
+                 alpha > alpha_start ? &frame->moves[0] : NULL, 0);
+    return alpha;
+}
+
+// iterative deepening at the root, the best move of each iteration is searched first in the next one
+// the state of the last search (table, history, expected pv) is reused, so iterations it already did are skipped
+// from the second iteration on the search starts with a narrow window around the previous score
+// and widens it on the side that failed until the score lands inside
+// a stopped search (deadline, node budget, fatal signal) still returns the best move found so far
+// with search_nodes set the search is deterministic: no clock, no depth limit below max_ply and random numbers seeded
+// only by the position, so it ends when the node budget runs out
+// movetime (0 for none) arms the deadline, the caller clears ctx->stop so a stop raised before the search starts is not lost
+bool search_best_move(struct search_context *ctx, struct cpu_move *best, int movetime) {
+    struct chess_game *game = &ctx->board;
+    struct search_frame *frame = &ctx->frames[0];
+    struct tt_entry entry;
+    unsigned long node_limit = search_nodes;
+    bool followed;
+    int depth;
+    bool finished = false;
+    int start_depth = 1;
+    int max_depth = node_limit ? ctx->max_ply - 1 : clamp(search_depth, 1, ctx->max_ply - 1);
+    int alpha;
+    int beta;
+    int delta;
+    int score = 0;
+    ktime_t start;
+
+    followed = search_restore_expected(ctx);
+    if (search_root_moves(ctx, ctx->seed) == 0)
+        return false;
+    ctx->nodes = 0;
+    ctx->node_limit = node_limit;
+    ctx->eval_probes = 0;
+    ctx->eval_hits = 0;
+    start = ktime_get();
+    if (movetime > 0)
+        search_start_deadline(ctx, movetime);
+
+    // the previous search already searched this position two plies below its root (or a ponder search at its own root)
+    // so the shallow iterations would only repeat what the table holds, the search starts at the depth it stored
+    if (tt_probe(game->key, &entry) && entry.bound == TT_EXACT && entry.depth > 1) {
+        start_depth = min((int)entry.depth, max_depth);
+        score = entry.score;
+        pr_debug("Chess: starting at depth %d from the table%s\n", start_depth, followed ? " along the expected line" : "");
+    }
+
+    for (depth = start_depth; depth <= max_depth; depth++) {
+        delta = aspiration_window;
+        if (depth > 1 && delta > 0 && abs(score) < MATE_SCORE - MAX_PLY) {
+            alpha = max(score - delta, -INFINITE_SCORE);
+            beta = min(score + delta, INFINITE_SCORE);
+        } else {
+            alpha = -INFINITE_SCORE;
+            beta = INFINITE_SCORE;
+        }
+
+        for (;;) {
+            score = search_root(ctx, depth, alpha, beta, 0);
+            if (ctx->stop)
+                break;
+            if (score <= alpha && alpha > -INFINITE_SCORE) {
+                alpha = max(score - delta, -INFINITE_SCORE);
+            } else if (score >= beta && beta < INFINITE_SCORE) {
+                beta = min(score + delta, INFINITE_SCORE);
+            } else {
+                break;
+            }
+            delta *= 2;
+        }
+        if (ctx->stop) {
+            pr_debug("Chess: search stopped during depth %d after %lu nodes\n", depth, ctx->nodes);
+            break;
+        }
+        pr_debug("Chess: depth %d score %d nodes %lu\n", depth, score, ctx->nodes);
+        finished = true;
+        ctx->line_length = frame->pv_length;
+        memcpy(ctx->line, frame->pv, frame->pv_length * sizeof(*frame->pv));
+    }
+
+    // an iteration stopped before any root move finished leaves the root pv empty, the move in front is still the best
+    // of the last finished iteration so its line goes back
+    if (finished && frame->pv_length == 0) {
+        memcpy(frame->pv, ctx->line, ctx->line_length * sizeof(*frame->pv));
+        frame->pv_length = ctx->line_length;
+    }
+
+    if (movetime > 0) {
+        search_cancel_deadline(ctx);
+        printk(KERN_INFO "Chess: searched %lld us with a %d ms deadline\n", ktime_us_delta(ktime_get(), start), movetime);
+    }
+
+    printk(KERN_INFO "Chess: best move %d,%d to %d,%d after %lu nodes, evaluation cache hit %lu of %lu (%lu%%)\n",
+           frame->moves[0].start_row, frame->moves[0].start_col, frame->moves[0].end_row, frame->moves[0].end_col, ctx->nodes,
+           ctx->eval_hits, ctx->eval_probes, ctx->eval_probes ? ctx->eval_hits * 100 / ctx->eval_probes : 0);
+    *best = frame->moves[0];
+
+    // without a finished iteration there is no line worth following in the next search
+    if (finished)
+        search_save_expected(ctx);
+    else
+        ctx->expected_length = 0;
+    return true;
+}
+
+// attacker's turn in the mate search: only checking moves are tried and no evaluation is done
+// true (with the line in the frame's pv) as soon as one check leaves every defence mated
+bool mate_attack(struct search_context *ctx, int plies, int ply) {
+    struct chess_game *game = &ctx->board;
+    struct search_frame *frame = &ctx->frames[ply];
+    bool mated;
+    int i;
+
+    frame->pv_length = 0;
+    if (search_should_stop(ctx) || plies <= 0)
+        return false;
+
+    frame->count = generate_moves(game, frame->moves, false);
+    score_moves(ctx, game, frame->moves, frame->count, ply);
+
+    for (i = 0; i < frame->count; i++) {
+        pick_move(frame->moves, frame->count, i);
+        frame->move = frame->moves[i];
+        make_move(game, &frame->move, &frame->undo);
+        if (in_check(game, -game->current_turn) || !in_check(game, game->current_turn)) {
+            unmake_move(game, &frame->move, &frame->undo);
+            continue;
+        }
+        mated = mate_defend(ctx, plies - 1, ply + 1);
+        unmake_move(game, &frame->move, &frame->undo);
+        if (ctx->stop)
+            return false;
+        if (mated) {
+            update_pv(ctx, ply, &frame->move);
+            return true;
+        }
+    }
+    return false;
+}
+
+// defender's turn in the mate search: every legal move (all of them are check evasions) has to lose
+// with no moves left it is mate if in check and stalemate (no mate) otherwise
+bool mate_defend(struct search_context *ctx, int plies, int ply) {
+    struct chess_game *game = &ctx->board;
+    struct search_frame *frame = &ctx->frames[ply];
+    bool escaped;
+    int legal = 0;
+    int i;
+
+    frame->pv_length = 0;
+    if (search_should_stop(ctx))
+        return false;
+
+    frame->count = generate_moves(game, frame->moves, false);
+    score_moves(ctx, game, frame->moves, frame->count, ply);
+
+    for (i = 0; i < frame->count; i++) {
+        pick_move(frame->moves, frame->count, i);
+        frame->move = frame->moves[i];
+        make_move(game, &frame->move, &frame->undo);
+        if (in_check(game, -game->current_turn)) {
+            unmake_move(game, &frame->move, &frame->undo);
+            continue;
+        }
+        legal++;
+        escaped = plies <= 0 || !mate_attack(ctx, plies - 1, ply + 1);
+        unmake_move(game, &frame->move, &frame->undo);
+        if (ctx->stop || escaped)
+            return false;
+        // the line shown follows the first defence tried
+        if (legal == 1)
+            update_pv(ctx, ply, &frame->move);
+    }
+
+    if (legal == 0)
+        return in_check(game, game->current_turn);
+    return true;
+}
+
+// proving a forced mate for the side to move on ctx->board, mate in 1, 2, ... up to max_moves so the shortest is found
+// the attacker only plays checks so quiet mating moves are not found, the line is left in ctx->frames[0].pv
+// movetime (0 for none) arms the deadline, a search stopped by it, the node budget or a fatal signal returns -1
+// because the mates it did not get to are not ruled out
+int mate_solve(struct search_context *ctx, int max_moves, int movetime) {
+    int found = 0;
+    int moves;
+
+    ctx->nodes = 0;
+    ctx->node_limit = search_nodes;
+    ctx->stop = false;
+    if (movetime > 0)
+        search_start_deadline(ctx, movetime);
+
+    for (moves = 1; moves <= max_moves; moves++) {
+        if (mate_attack(ctx, 2 * moves - 1, 0)) {
+            found = moves;
+            break;
+        }
+        if (ctx->stop) {
+            found = -1;
+            break;
+        }
+    }
+
+    if (movetime > 0)
+        search_cancel_deadline(ctx);
+    if (found > 0)
+        printk(KERN_INFO "Chess: mate in %d found after %lu nodes\n", found, ctx->nodes);
+    else if (found < 0)
+        printk(KERN_INFO "Chess: mate search stopped during mate in %d after %lu nodes\n", moves, ctx->nodes);
+    else
+        printk(KERN_INFO "Chess: no mate in %d after %lu nodes\n", max_moves, ctx->nodes);
+    return found;
+}
+
+// writing a move the way 02 takes it, e.g. WQd1-h5xBP or WPe7-e8yWQ (the move has not been played yet)
+void format_move(struct chess_game *game, struct cpu_move *move, char *buf) {
+    char piece[4] = "**";
+    char target[4] = "**";
+    char promotion[4] = "**";
+    int len;
+
+    piece_to_char(game->board[move->start_row][move->start_col], piece);
+    len = sprintf(buf, "%s%c%d-%c%d", piece, 'a' + move->start_col, move->start_row + 1, 'a' + move->end_col, move->end_row + 1);
+    if (game->board[move->end_row][move->end_col] != EMPTY) {
+        piece_to_char(game->board[move->end_row][move->end_col], target);
+        len += sprintf(buf + len, "x%s", target);
+    }
+    if (move->promotion) {
+        piece_to_char(move->promotion, promotion);
+        sprintf(buf + len, "y%s", promotion);
+    }
+}
+
+// writing a line of moves separated by spaces, played out on a copy of game
+void format_line(struct chess_game *game, struct cpu_move *line, int length, char *buf, size_t size) {
+    struct chess_game board = *game;
+    struct search_undo undo;
+    char move[16];
+    size_t used = 0;
+    int i;
+
+    search_prepare(&board);
+    buf[0] = '\0';
+    for (i = 0; i < length && used < size; i++) {
+        format_move(&board, &line[i], move);
+        used += snprintf(buf + used, size - used, i ? " %s" : "%s", move);
+        make_move(&board, &line[i], &undo);
+    }
+}
+
+// setting up the background analysis of the game's position with lines lines (fewer if there are fewer legal moves)
+// the root moves and the search state are set up here so the work never races dev_write on them,
+// dev_write queues the work after publishing the reply
+bool analysis_start(int lines, int threads) {
+    struct search_context *ctx = &search_ctx;
+
+    ctx->board = game;
+    search_prepare(&ctx->board);
+    analysis.root = ctx->board;
+    nnue_attach(ctx, 0);
+    search_age(ctx);
+    if (search_root_moves(ctx, ctx->seed) == 0)
+        return false;
+    ctx->nodes = 0;
+    ctx->node_limit = 0;
+    ctx->stop = false;
+    analysis.lines = min(lines, ctx->frames[0].count);
+    analysis.threads = threads;
+    analysis.running = true;
+    return true;
+}
+
+// raising the stop flag and waiting for the work to finish, the work publishes its last line on the way out
+void analysis_stop(void) {
+    if (!analysis.running)
+        return;
+    WRITE_ONCE(search_ctx.stop, true);
+    flush_work(&analysis.work);
+    analysis.running = false;
+}
+
+// iterative deepening where every iteration searches the root once per line, line k leaving out the k moves
+// already reported above it, only finished iterations are published so the lines of one block always agree
+void analysis_work(struct work_struct *work) {
+    struct search_context *ctx = &search_ctx;
+    struct search_frame *frame = &ctx->frames[0];
+    struct analysis_line *line;
+    char move[16];
+    size_t used;
+    int max_depth = ctx->max_ply - 1;
+    int depth;
+    int score;
+    int k;
+
+    if (analysis_time_ms > 0)
+        search_start_deadline(ctx, analysis_time_ms);
+    search_helpers_start(ctx, analysis.threads);
+
+    for (depth = 1; depth <= max_depth; depth++) {
+        for (k = 0; k < analysis.lines; k++) {
+            line = &analysis.line[k];
+            score = search_root(ctx, depth, -INFINITE_SCORE, INFINITE_SCORE, k);
+            if (ctx->stop)
+                break;
+            line->score = score;
+            line->pv_length = frame->pv_length;
+            memcpy(line->pv, frame->pv, frame->pv_length * sizeof(*frame->pv));
+        }
+        if (ctx->stop)
+            break;
+
+        // one INFO line per pv, mate scores are given in moves (negative when the side to move gets mated)
+        used = 0;
+        for (k = 0; k < analysis.lines && used < sizeof(analysis.text); k++) {
+            line = &analysis.line[k];
+            score = line->score;
+            if (abs(score) >= MATE_SCORE - MAX_PLY)
+                used += snprintf(analysis.text + used, sizeof(analysis.text) - used, "INFO DEPTH %d LINE %d MATE %d NODES %lu PV ",
+                                 depth, k + 1, score > 0 ? (MATE_SCORE - score + 1) / 2 : -(MATE_SCORE + score) / 2, ctx->nodes);
+            else
+                used += snprintf(analysis.text + used, sizeof(analysis.text) - used, "INFO DEPTH %d LINE %d SCORE %d NODES %lu PV ",
+                                 depth, k + 1, score, ctx->nodes);
+            if (used >= sizeof(analysis.text))
+                break;
+            format_line(&analysis.root, line->pv, line->pv_length, analysis.text + used, sizeof(analysis.text) - used);
+            strlcat(analysis.text, "\n", sizeof(analysis.text));
+            used = strlen(analysis.text);
+        }
+        analysis_publish(analysis.text);
+    }
+
+    search_helpers_stop();
+    if (analysis_time_ms > 0)
+        search_cancel_deadline(ctx);
+    printk(KERN_INFO "Chess: analysis stopped at depth %d after %lu nodes\n", depth, ctx->nodes);
+
+    format_move(&analysis.root, &frame->moves[0], move);
+    snprintf(analysis.text, sizeof(analysis.text), "BESTMOVE %s\n", move);
+    analysis_publish(analysis.text);
+}
+
+// appending text to the reply, when it is full the oldest whole lines are dropped and message_base
+// moves past them so the offsets readers hold still point at the same bytes
+void analysis_publish(const char *text) {
+    size_t length = strlen(text);
+    size_t drop;
+
+    mutex_lock(&message_lock);
+    if (reply_size + length >= sizeof(reply)) {
+        drop = min(reply_size, reply_size + length - (sizeof(reply) - 1));
+        while (drop > 0 && drop < reply_size && reply[drop - 1] != '\n')
+            drop++;
+        memmove(reply, reply + drop, reply_size - drop);
+        reply_size -= drop;
+        message_base += drop;
+    }
+    length = min(length, sizeof(reply) - 1 - reply_size);
+    memcpy(reply + reply_size, text, length);
+    reply_size += length;
+    reply[reply_size] = '\0';
+    mutex_unlock(&message_lock);
+}
+
+// pondering on game (the position right after a cpu move) once the predicted reply is played on the search board
+// like analysis_start everything is set up before the work is queued
+void ponder_start(struct chess_game *game, struct cpu_move *predicted) {
+    struct search_context *ctx = &search_ctx;
+    struct search_undo undo;
+
+    ctx->board = *game;
+    search_prepare(&ctx->board);
+    make_move(&ctx->board, predicted, &undo);
+    nnue_attach(ctx, 0);
+    search_age(ctx);
+    ctx->stop = false;
+    ponder.predicted = *predicted;
+    ponder.found = false;
+    ponder.hit = false;
+    ponder.aged = true;
+    ponder.running = true;
+    queue_work(system_unbound_wq, &ponder.work);
+}
+
+// stopping the ponder search and forgetting its move, what it stored in the transposition table stays for the next search
+void ponder_stop(void) {
+    if (!ponder.running)
+        return;
+    WRITE_ONCE(search_ctx.stop, true);
+    flush_work(&ponder.work);
+    ponder.running = false;
+    printk(KERN_INFO "Chess: ponder stopped after %lu nodes\n", search_ctx.nodes);
+}
+
+// the ponder search has no deadline of its own, it ends at search_depth or when stopped
+void ponder_work(struct work_struct *work) {
+    ponder.found = search_best_move(&search_ctx, &ponder.best, 0);
+}
+
+// called after the player's move is performed, piece is what now stands on the end square (the promotion if any)
+void ponder_player_moved(int start_row, int start_col, int end_row, int end_col, int piece) {
+    struct cpu_move *predicted = &ponder.predicted;
+
+    if (!ponder.running)
+        return;
+    if (predicted->start_row == start_row && predicted->start_col == start_col && predicted->end_row == end_row &&
+        predicted->end_col == end_col && (!predicted->promotion || predicted->promotion == piece)) {
+        ponder.hit = true;
+        ponder.hit_time = ktime_get();
+        printk(KERN_INFO "Chess: ponder hit\n");
+    } else {
+        ponder_stop();
+    }
+}
+
+// after a hit the ponder search becomes the cpu search: it gets what is left of search_movetime_ms since the hit
+// (it may well be done already) and its move is used without searching again
+// aged is set when a ponder search since the last cpu move already aged the ordering tables
+bool ponder_finish(struct cpu_move *best, bool *aged) {
+    int remaining;
+    bool deadline = false;
+
+    *aged = ponder.aged;
+    ponder.aged = false;
+    if (!ponder.running)
+        return false;
+    if (!ponder.hit) {
+        ponder_stop();
+        return false;
+    }
+
+    remaining = search_movetime_ms - (int)ktime_ms_delta(ktime_get(), ponder.hit_time);
+    if (search_movetime_ms > 0 && remaining <= 0) {
+        WRITE_ONCE(search_ctx.stop, true);
+    } else if (search_movetime_ms > 0) {
+        search_start_deadline(&search_ctx, remaining);
+        deadline = true;
+    }
+    flush_work(&ponder.work);
+    if (deadline)
+        search_cancel_deadline(&search_ctx);
+    ponder.running = false;
+
+    printk(KERN_INFO "Chess: ponder search used after %lu nodes\n", search_ctx.nodes);
+    *best = ponder.best;
+    return ponder.found;
+}
+
+// a lazy smp helper: it searches the same root as the search that started it, on its own board and ordering tables,
+// odd helpers one ply deeper, and all it finds reaches the other threads through the transposition table
+// it has no result of its own and waits once done, since the thread must still be there for kthread_stop
+static int search_helper(void *data) {
+    struct search_context *ctx = data;
+    int max_depth = clamp(search_depth, 1, ctx->max_ply - 1);
+    int depth;
+
+    if (search_root_moves(ctx, ctx->seed) > 0) {
+        for (depth = 1 + (ctx->thread & 1); depth <= max_depth && !READ_ONCE(ctx->stop); depth++)
+            search_root(ctx, depth, -INFINITE_SCORE, INFINITE_SCORE, 0);
+    }
+
+    while (!kthread_should_stop()) {
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop())
+            schedule();
+        __set_current_state(TASK_RUNNING);
+    }
+    return 0;
+}
+
+// a ybwc helper: it sleeps until another thread offers a split point, searches moves of it until none is left
+// and goes back to sleep, kthread_stop wakes it for good
+// the generation is read before looking so a split point offered after the look still wakes it
+static int search_ybwc_helper(void *data) {
+    struct search_context *ctx = data;
+    struct split_point *sp;
+    int generation;
+
+    atomic_inc(&idle_helpers);
+    while (!kthread_should_stop()) {
+        generation = atomic_read(&split_generation);
+        sp = split_steal(ctx, NULL);
+        if (!sp) {
+            wait_event_interruptible(split_wait, kthread_should_stop() || atomic_read(&split_generation) != generation);
+            continue;
+        }
+        atomic_dec(&idle_helpers);
+        split_join(ctx, sp);
+        ctx->split = NULL;
+        atomic_inc(&idle_helpers);
+    }
+    atomic_dec(&idle_helpers);
+    return 0;
+}
+
+// getting the context of helper thread (1 and up) with a search stack for max_ply, allocated the first time it is needed
+static struct search_context *search_helper_context(int thread, int max_ply) {
+    struct search_context *helper = helper_ctx[thread - 1];
+
+    if (!helper) {
+        helper = vzalloc(sizeof(*helper));
+        if (!helper)
+            return NULL;
+        helper->thread = thread;
+        helper_ctx[thread - 1] = helper;
+    }
+    if (!helper->frames || helper->max_ply != max_ply) {
+        search_context_free(helper);
+        helper->frames = vzalloc(array_size(max_ply, sizeof(*helper->frames)));
+        if (nnue && helper->frames)
+            helper->accumulators = vmalloc(array_size(max_ply + 1, sizeof(*helper->accumulators)));
+        if (!helper->frames || (nnue && !helper->accumulators)) {
+            search_context_free(helper);
+            return NULL;
+        }
+        helper->max_ply = max_ply;
+    }
+    return helper;
+}
+
+// starting threads - 1 helpers for the search ctx is about to run, each one bound to the next cpu of search_cpulist
+// (or of the online cpus), they start with ctx's board and a copy of its history and countermoves
+// root splitting has no threads of its own: its helpers are min(threads, search_root_fanout) contexts for the root
+// workqueue's items (ctx only waits for them), one item per context
+// a fixed node search stays on one thread since helpers would make its result depend on timing
+int search_helpers_start(struct search_context *ctx, int threads) {
+    struct search_context *helper;
+    struct task_struct *task;
+    int cpu;
+    int ply;
+    int i;
+
+    helper_count = 0;
+    threads = clamp(threads, 1, MAX_SEARCH_THREADS);
+    if (search_nodes > 0 || threads == 1)
+        return 0;
+    if (search_smp_mode == SMP_ROOT)
+        threads = min(threads, clamp(search_root_fanout, 1, MAX_SEARCH_THREADS - 1)) + 1;
+    if (!search_cpulist[0] || cpulist_parse(search_cpulist, &helper_cpus))
+        cpumask_copy(&helper_cpus, cpu_online_mask);
+    cpumask_and(&helper_cpus, &helper_cpus, cpu_online_mask);
+    if (cpumask_empty(&helper_cpus))
+        cpumask_copy(&helper_cpus, cpu_online_mask);
+
+    cpu = raw_smp_processor_id();
+    for (i = 1; i < threads; i++) {
+        helper = search_helper_context(i, ctx->max_ply);
+        if (!helper)
+            break;
+        helper->board = ctx->board;
+        nnue_attach(helper, 0);
+        memcpy(helper->history, ctx->history, sizeof(ctx->history));
+        memcpy(helper->countermoves, ctx->countermoves, sizeof(ctx->countermoves));
+        for (ply = 0; ply < helper->max_ply; ply++)
+            memset(helper->frames[ply].killers, 0, sizeof(helper->frames[ply].killers));
+        helper->seed = ctx->seed + i * 0x9e3779b97f4a7c15ULL;
+        helper->nodes = 0;
+        helper->node_limit = 0;
+        helper->eval_probes = 0;
+        helper->eval_hits = 0;
+        helper->stop = false;
+
+        cpu = cpumask_next(cpu, &helper_cpus);
+        if (cpu >= nr_cpu_ids)
+            cpu = cpumask_first(&helper_cpus);
+        helper->split = NULL;
+        helper->cut = false;
+        helper->split_count = 0;
+        if (search_smp_mode == SMP_ROOT) {
+            helper_tasks[helper_count++] = NULL;
+            continue;
+        }
+        task = kthread_create(search_smp_mode == SMP_YBWC ? search_ybwc_helper : search_helper, helper, "chess_search/%d", i);
+        if (IS_ERR(task))
+            break;
+        kthread_bind(task, cpu);
+        helper_tasks[helper_count++] = task;
+        wake_up_process(task);
+    }
+    ybwc_active = search_smp_mode == SMP_YBWC && helper_count > 0;
+    root_active = search_smp_mode == SMP_ROOT && helper_count > 0;
+    return helper_count;
+}
+
+// raising every helper's stop flag and waiting for the threads to end
+void search_helpers_stop(void) {
+    unsigned long nodes = 0;
+    unsigned long probes = 0;
+    unsigned long hits = 0;
+    int i;
+
+    if (helper_count == 0)
+        return;
+    ybwc_active = false;
+    root_active = false;
+    for (i = 0; i < helper_count; i++)
+        WRITE_ONCE(helper_ctx[i]->stop, true);
+    for (i = 0; i < helper_count; i++) {
+        if (helper_tasks[i])
+            kthread_stop(helper_tasks[i]);
+        nodes += helper_ctx[i]->nodes;
+        probes += helper_ctx[i]->eval_probes;
+        hits += helper_ctx[i]->eval_hits;
+    }
+    printk(KERN_INFO "Chess: %d helper threads searched %lu nodes, evaluation cache hit %lu of %lu\n", helper_count, nodes,
+           hits, probes);
+    helper_count = 0;
+}
+
+// releasing the helper contexts when the module goes away
+void search_helpers_free(void) {
+    int i;
+
+    for (i = 0; i < MAX_SEARCH_THREADS - 1; i++) {
+        if (!helper_ctx[i])
+            continue;
+        search_context_free(helper_ctx[i]);
+        vfree(helper_ctx[i]);
+        helper_ctx[i] = NULL;
+    }
+}
+
+// a split point's moves are no longer needed once one of them failed high there or above,
+// or once the owner of it or of one above stopped (its deadline, or it was itself working for an aborted split point)
+bool split_aborted(struct split_point *sp) {
+    for (; sp; sp = sp->parent) {
+        if (READ_ONCE(sp->cutoff) || READ_ONCE(sp->owner->stop))
+            return true;
+    }
+    return false;
+}
+
+// splitting only pays for itself with enough depth left and someone idle to help
+bool search_can_split(struct search_context *ctx, int depth) {
+    return ybwc_active && depth >= ybwc_min_depth && ctx->split_count < MAX_SPLITS && atomic_read(&idle_helpers) > 0;
+}
+
+// sharing the moves of the node at ply from first on: the split point goes onto this thread's deque, the owner
+// searches moves of it like any helper that joined (and like them gives up its move once the split point is cut),
+// then takes it off the deque so no one else can join
+// until the helpers still on it are done the owner joins the split points they opened below it, and sleeps only
+// when there is none, its board and network stack at ply are put back from the split point afterwards
+// the result is the best score (alpha if nothing beat it) and the frame's pv is set if a move did
+int search_split(struct search_context *ctx, int depth, int alpha, int beta, int ply, int first) {
+    struct search_frame *frame = &ctx->frames[ply];
+    struct split_deque *deque = &split_deques[ctx->thread];
+    struct split_point *sp = &ctx->splits[ctx->split_count];
+    struct split_point *below;
+    int generation;
+    bool waiting;
+    int i;
+
+    sp->owner = ctx;
+    sp->parent = ctx->split;
+    sp->board = ctx->board;
+    sp->previous = ctx->frames[ply - 1].move;
+    sp->moves = frame->moves;
+    sp->count = frame->count;
+    sp->depth = depth;
+    sp->beta = beta;
+    sp->ply = ply;
+    sp->check = in_check(&ctx->board, ctx->board.current_turn);
+    spin_lock_init(&sp->lock);
+    sp->next = first;
+    sp->alpha = alpha;
+    sp->cutoff = false;
+    sp->workers = 0;
+    sp->closing = false;
+    sp->pv_length = 0;
+
+    ctx->split_count++;
+    spin_lock(&deque->lock);
+    deque->splits[deque->count++] = sp;
+    spin_unlock(&deque->lock);
+    atomic_inc(&split_generation);
+    wake_up(&split_wait);
+
+    ctx->split = sp;
+    search_split_work(ctx, sp);
+
+    spin_lock(&deque->lock);
+    for (i = 0; i < deque->count && deque->splits[i] != sp; i++)
+        ;
+    memmove(&deque->splits[i], &deque->splits[i + 1], (deque->count - i - 1) * sizeof(*deque->splits));
+    deque->count--;
+    spin_unlock(&deque->lock);
+    spin_lock(&sp->lock);
+    sp->closing = true;
+    spin_unlock(&sp->lock);
+
+    for (;;) {
+        generation = atomic_read(&split_generation);
+        spin_lock(&sp->lock);
+        waiting = sp->workers > 0;
+        spin_unlock(&sp->lock);
+        if (!waiting)
+            break;
+        below = split_steal(ctx, sp);
+        if (below) {
+            split_join(ctx, below);
+            ctx->split = sp;
+            continue;
+        }
+        wait_event(split_wait, !READ_ONCE(sp->workers) || atomic_read(&split_generation) != generation);
+    }
+    ctx->board = sp->board;
+    nnue_attach(ctx, ply);
+    ctx->split = sp->parent;
+    ctx->cut = sp->parent && split_aborted(sp->parent);
+    ctx->split_count--;
+
+    spin_lock(&sp->lock);
+    if (sp->pv_length > 0) {
+        memcpy(frame->pv, sp->pv, sp->pv_length * sizeof(*sp->pv));
+        frame->pv_length = sp->pv_length;
+    }
+    alpha = sp->alpha;
+    spin_unlock(&sp->lock);
+    return alpha;
+}
+
+// taking moves of a split point one at a time (in ordering score order) and searching them with the same
+// pvs and late move reductions search_alphabeta uses, against the best score any thread found so far
+// a move beating it updates the split point, one reaching beta is a cutoff and aborts the others
+void search_split_work(struct search_context *ctx, struct split_point *sp) {
+    struct chess_game *game = &ctx->board;
+    struct search_frame *frame = &ctx->frames[sp->ply];
+    struct search_frame *child = &ctx->frames[sp->ply + 1];
+    int ply = sp->ply;
+    int depth = sp->depth;
+    int index;
+    int alpha;
+    int score;
+    int reduction;
+    bool quiet;
+
+    for (;;) {
+        spin_lock(&sp->lock);
+        if (sp->next >= sp->count || split_aborted(sp)) {
+            spin_unlock(&sp->lock);
+            break;
+        }
+        index = sp->next++;
+        pick_move(sp->moves, sp->count, index);
+        frame->move = sp->moves[index];
+        alpha = sp->alpha;
+        spin_unlock(&sp->lock);
+
+        make_move(game, &frame->move, &frame->undo);
+        if (in_check(game, -game->current_turn)) {
+            unmake_move(game, &frame->move, &frame->undo);
+            continue;
+        }
+        quiet = frame->undo.captured == EMPTY && abs(frame->move.promotion) != QUEEN;
+
+        // the move's place in the list stands in for the count of legal moves before it
+        reduction = 0;
+        if (quiet && !sp->check && depth >= lmr_min_depth && index + 1 > lmr_min_moves && frame->move.score < COUNTERMOVE_SCORE &&
+            !in_check(game, game->current_turn))
+            reduction = min(lmr_table[min(depth, MAX_PLY - 1)][min(index + 1, LMR_MOVES - 1)], depth - 1);
+
+        score = -search_alphabeta(ctx, depth - 1 - reduction, -alpha - 1, -alpha, ply + 1);
+        if (score > alpha && reduction > 0 && !search_aborted(ctx))
+            score = -search_alphabeta(ctx, depth - 1, -alpha - 1, -alpha, ply + 1);
+        if (score > alpha && score < sp->beta && !search_aborted(ctx))
+            score = -search_alphabeta(ctx, depth - 1, -sp->beta, -alpha, ply + 1);
+        unmake_move(game, &frame->move, &frame->undo);
+        if (search_aborted(ctx))
+            break;
+
+        spin_lock(&sp->lock);
+        if (score > sp->alpha && !sp->cutoff) {
+            sp->alpha = score;
+            sp->pv[0] = frame->move;
+            memcpy(&sp->pv[1], child->pv, child->pv_length * sizeof(*child->pv));
+            sp->pv_length = child->pv_length + 1;
+            if (score >= sp->beta)
+                WRITE_ONCE(sp->cutoff, true);
+        }
+        spin_unlock(&sp->lock);
+        if (score >= sp->beta && quiet)
+            update_quiet_stats(ctx, game, &frame->move, depth, ply);
+    }
+}
+
+// looking through every other thread's deque, oldest split point first, for one with moves left to join
+// with below set only split points opened (maybe further down) while searching a move of below are taken
+// its board is copied by the caller, the deque lock keeps the owner from taking it away meanwhile
+struct split_point *split_steal(struct search_context *ctx, struct split_point *below) {
+    struct split_deque *deque;
+    struct split_point *sp;
+    struct split_point *above;
+    int thread;
+    int i;
+
+    for (thread = 0; thread < MAX_SEARCH_THREADS; thread++) {
+        deque = &split_deques[(ctx->thread + thread) % MAX_SEARCH_THREADS];
+        if (!READ_ONCE(deque->count))
+            continue;
+        spin_lock(&deque->lock);
+        for (i = 0; i < deque->count; i++) {
+            sp = deque->splits[i];
+            for (above = sp->parent; below && above && above != below; above = above->parent)
+                ;
+            if (below && !above)
+                continue;
+            spin_lock(&sp->lock);
+            if (sp->next < sp->count && !split_aborted(sp)) {
+                sp->workers++;
+                spin_unlock(&sp->lock);
+                spin_unlock(&deque->lock);
+                return sp;
+            }
+            spin_unlock(&sp->lock);
+        }
+        spin_unlock(&deque->lock);
+    }
+    return NULL;
+}
+
+// searching moves of a split point split_steal joined for ctx until none is left, with ctx's board copied from it,
+// then leaving it: the cut that ended the work only concerned the split point, the last worker to leave a closing
+// split point wakes its owner
+void split_join(struct search_context *ctx, struct split_point *sp) {
+    bool last;
+
+    ctx->board = sp->board;
+    nnue_attach(ctx, sp->ply);
+    ctx->frames[sp->ply - 1].move = sp->previous;
+    ctx->split = sp;
+    search_split_work(ctx, sp);
+    ctx->cut = false;
+
+    spin_lock(&sp->lock);
+    sp->workers--;
+    last = sp->workers == 0 && sp->closing;
+    spin_unlock(&sp->lock);
+    if (last)
+        wake_up(&split_wait);
+}
+
+// root moves of root_split searched one after the other on the job's own helper context: each with a null window
+// at the best score so far and again with the full window if it beats it, a move that finished beating the best
+// score becomes the best line
+// the context's cut flag is latched once root_split is aborted (a fail high or the owner stopping)
+void search_root_job(struct work_struct *work) {
+    struct root_job *job = container_of(work, struct root_job, work);
+    struct split_point *sp = &root_split;
+    struct search_context *ctx = helper_ctx[job->slot];
+    struct search_frame *frame = &ctx->frames[0];
+    int index;
+    int alpha;
+    int score;
+
+    ctx->split = sp;
+    for (;;) {
+        spin_lock(&sp->lock);
+        if (sp->next >= sp->count || split_aborted(sp)) {
+            spin_unlock(&sp->lock);
+            break;
+        }
+        index = sp->next++;
+        alpha = sp->alpha;
+        spin_unlock(&sp->lock);
+
+        ctx->board = sp->board;
+        nnue_attach(ctx, 0);
+        frame->move = sp->moves[index];
+        make_move(&ctx->board, &frame->move, &frame->undo);
+        score = -search_alphabeta(ctx, sp->depth - 1, -alpha - 1, -alpha, 1);
+        if (score > alpha && score < sp->beta && !search_aborted(ctx))
+            score = -search_alphabeta(ctx, sp->depth - 1, -sp->beta, -alpha, 1);
+        unmake_move(&ctx->board, &frame->move, &frame->undo);
+        if (search_aborted(ctx))
+            break;
+
+        spin_lock(&sp->lock);
+        if (score > sp->alpha && !sp->cutoff) {
+            sp->alpha = score;
+            sp->pv[0] = frame->move;
+            memcpy(&sp->pv[1], ctx->frames[1].pv, ctx->frames[1].pv_length * sizeof(*sp->pv));
+            sp->pv_length = ctx->frames[1].pv_length + 1;
+            if (score >= sp->beta)
+                WRITE_ONCE(sp->cutoff, true);
+        }
+        spin_unlock(&sp->lock);
+    }
+    ctx->split = NULL;
+    ctx->cut = false;
+    ctx->stop = false;
+    if (atomic_dec_and_test(&root_pending))
+        complete(&root_done);
+}
+
+// queueing a job for every helper context (fewer if fewer root moves are left) and sleeping until all of them ended,
+// together they search every root move from first on
+// the result is the best score (alpha if nothing beat it), with best_index and the root pv set if a move did
+// a fatal signal while waiting stops the jobs like the deadline does
+int search_root_split(struct search_context *ctx, int depth, int alpha, int beta, int first, int *best_index) {
+    struct search_frame *frame = &ctx->frames[0];
+    struct split_point *sp = &root_split;
+    int jobs = min(helper_count, frame->count - first);
+    int i;
+
+    sp->owner = ctx;
+    sp->parent = NULL;
+    sp->board = ctx->board;
+    sp->moves = frame->moves;
+    sp->count = frame->count;
+    sp->depth = depth;
+    sp->beta = beta;
+    sp->ply = 0;
+    spin_lock_init(&sp->lock);
+    sp->next = first;
+    sp->alpha = alpha;
+    sp->cutoff = false;
+    sp->workers = 0;
+    sp->pv_length = 0;
+
+    reinit_completion(&root_done);
+    atomic_set(&root_pending, jobs);
+    for (i = 0; i < jobs; i++)
+        queue_work(root_wq, &root_jobs[i].work);
+    if (wait_for_completion_killable(&root_done)) {
+        WRITE_ONCE(ctx->stop, true);
+        wait_for_completion(&root_done);
+    }
+
+    if (sp->pv_length == 0)
+        return alpha;
+    for (i = first; i < frame->count - 1 && !same_move(&frame->moves[i], &sp->pv[0]); i++)
+        ;
+    *best_index = i;
+    memcpy(frame->pv, sp->pv, sp->pv_length * sizeof(*sp->pv));
+    frame->pv_length = sp->pv_length;
+    return sp->alpha;
+}
+
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Sofia Gomes");
 MODULE_DESCRIPTION("Linux kernel module for playing chess game");
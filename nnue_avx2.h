@@ -0,0 +1,13 @@
+#ifndef CHESS_NNUE_AVX2_H
+#define CHESS_NNUE_AVX2_H
+
+#include <linux/types.h>
+
+// the network's avx2 code, built in its own object with the FPU flags (see Kbuild) so chess.o keeps the kernel's
+// no-FPU flags, chess.c only calls it when the CPU has avx2 and only between kernel_fpu_begin and kernel_fpu_end
+void nnue_layer_avx2(const u8 *input, int inputs, const s8 *weights, const s32 *biases, u8 *output, int outputs,
+                     int shift); // runs one hidden layer
+void nnue_add_avx2(s16 *values, const s16 *weights, int count); // adds a feature's weights to first layer sums
+void nnue_sub_avx2(s16 *values, const s16 *weights, int count); // takes a feature's weights off first layer sums
+
+#endif